@@ -0,0 +1,507 @@
+/**
+  \author Matthew Strait
+  \brief Checks that every kernel this CPU supports, and redoing events
+  from their candidates, give exactly the same answers as the scalar
+  kernel. Run with "make check". Needs only libidivc, not ROOT.
+
+  Events are random, or built so that several hits in a detector have
+  corrected times within a float rounding of each other, which is where
+  the faster kernels would go wrong if anywhere, or so that more hits
+  than are kept as candidates are within a nanosecond, so that moving
+  the constants can make a hit that was left out first. Half of them
+  have their hits in time order, which is what the early kernel is
+  quick for. The scalar kernel itself is checked against the time
+  correction as idivc did it before there was a library, so that the
+  output doesn't change. Also checks the text format of the constants,
+  the summary, and that constants suggested from residuals converge.
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "idivc_lib.h"
+
+// Events of each kind per pass
+static const int NEVENT = 4000;
+
+// A fixed generator, so that failures can be reproduced anywhere
+static uint64_t rngstate = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng()
+{
+  rngstate ^= rngstate << 13;
+  rngstate ^= rngstate >> 7;
+  rngstate ^= rngstate << 17;
+  return rngstate;
+}
+
+// Uniform in [lo, hi)
+static double uniform(const double lo, const double hi)
+{
+  return lo + (hi - lo)*(rng() >> 11)*0x1p-53;
+}
+
+static int randint(const int n)
+{
+  return rng() % n;
+}
+
+enum event_kind { EV_RANDOM, EV_TIES, EV_CROWDED, EV_IDONLY, EV_NKIND };
+static const char * const kindnames[EV_NKIND] = { "random", "near-tie",
+                                                  "crowded", "ID only" };
+
+static void set_random_consts(idivc_consts * const consts)
+{
+  for(int p = 0; p < IDIVC_NPMT; p++)
+    idivc_consts_set(consts, p, randint(4000)/100.0 - 20);
+}
+
+/* Fills one event of nslot slots. Slots past the hits are empty. */
+static void make_event(const event_kind kind, const idivc_consts * consts,
+                       const size_t nslot, double * const tstart,
+                       short * const pmt)
+{
+  const size_t nhit = randint(nslot + 1);
+  for(size_t i = 0; i < nslot; i++){
+    tstart[i] = 0;
+    pmt[i] = -1;
+  }
+
+  for(size_t i = 0; i < nhit; i++){
+    // Mostly good hits, but some in unknown PMTs or with no time
+    pmt[i] = kind == EV_IDONLY? randint(IDIVC_NIDPMT)
+                              : randint(IDIVC_NPMT + 4) - 2;
+    tstart[i] = randint(20)? uniform(1, 1100): -uniform(0, 5)*randint(2);
+  }
+
+  if((kind != EV_TIES && kind != EV_CROWDED) || nhit == 0) return;
+
+  // Overwrite a few hits in each detector so that their corrected times
+  // are the same or a rounding apart, or for crowded events, so that
+  // many are within a nanosecond
+  const double base[2] = { uniform(30, 900), uniform(30, 900) };
+  const int nties = kind == EV_CROWDED? 4*IDIVC_NCAND: 2 + randint(6);
+  for(int k = 0; k < nties; k++){
+    const size_t i = randint(nhit);
+    const int det = randint(2);
+    const int p = det? IDIVC_NIDPMT + randint(IDIVC_NPMT - IDIVC_NIDPMT)
+                     : randint(IDIVC_NIDPMT);
+    const double nudge[] = { 0, 0, 1e-7, -1e-7, 3e-5, -3e-5, 1e-12 };
+    pmt[i] = p;
+    tstart[i] = base[det] - idivc_consts_get(consts, p) + (kind == EV_CROWDED?
+      uniform(0, 1): nudge[randint(sizeof(nudge)/sizeof(nudge[0]))]*base[det]);
+    if(tstart[i] <= 0) tstart[i] = base[det];
+  }
+}
+
+/* Puts the slots of an event in order of raw time, which puts the
+empty ones first, where they do no harm. */
+static void sort_event(const size_t nslot, double * const tstart,
+                       short * const pmt)
+{
+  std::pair<double, short> hits[1024];
+  for(size_t i = 0; i < nslot; i++)
+    hits[i] = std::make_pair(tstart[i], pmt[i]);
+  std::stable_sort(hits, hits + nslot);
+  for(size_t i = 0; i < nslot; i++){
+    tstart[i] = hits[i].first;
+    pmt[i] = hits[i].second;
+  }
+}
+
+static bool same(const idivc_result & a, const idivc_result & b)
+{
+  return !memcmp(&a, &b, sizeof(idivc_result));
+}
+
+/* The time correction as idivc first did it, for nslot slots. valid is
+set as the library documents it. */
+static idivc_result reference(const idivc_consts * const consts,
+                              const size_t nslot, const double * tstart,
+                              const short * pmt)
+{
+  idivc_result out;
+  out.timeid = out.timeiv = 9999;
+  out.firstidpmt = out.firstivpmt = -1;
+
+  for(size_t i = 0; i < nslot; i++){
+    if(pmt[i] < 0 || pmt[i] >= IDIVC_NPMT) continue;
+    const double time = tstart[i] + idivc_consts_get(consts, pmt[i]);
+    if(tstart[i] <= 0) continue;
+    if(pmt[i] < IDIVC_NIDPMT){
+      if(time < out.timeid){
+        out.timeid = time;
+        out.firstidpmt = pmt[i];
+      }
+    }
+    else{
+      if(time < out.timeiv){
+        out.timeiv = time;
+        out.firstivpmt = pmt[i];
+      }
+    }
+  }
+
+  out.valid = (out.timeid <= 999)*IDIVC_VALID_ID
+            | (out.timeiv <= 999)*IDIVC_VALID_IV;
+  if(out.timeiv > 999) out.timeiv = -1;
+  if(out.timeid > 999) out.timeid = -1;
+  return out;
+}
+
+static void printresult(const char * const what, const idivc_result & r)
+{
+  fprintf(stderr, "  %-8s ID %.9g in %d, IV %.9g in %d\n", what,
+          r.timeid, r.firstidpmt, r.timeiv, r.firstivpmt);
+}
+
+/* Checks every kernel against the scalar one on events of one kind.
+Returns the number of events that differ. */
+static int check_kernels(const event_kind kind, const bool sorted,
+                         const size_t nslot, const idivc_consts * consts)
+{
+  static double tstart[NEVENT*1024];
+  static short pmt[NEVENT*1024];
+  static idivc_result want[NEVENT], got[NEVENT];
+
+  for(int e = 0; e < NEVENT; e++){
+    make_event(kind, consts, nslot, tstart + e*nslot, pmt + e*nslot);
+    if(sorted) sort_event(nslot, tstart + e*nslot, pmt + e*nslot);
+  }
+
+  idivc_use_kernel("scalar");
+  idivc_process(consts, NEVENT, nslot, tstart, pmt, want);
+
+  int nbad = 0;
+  for(int e = 0; e < NEVENT; e++){
+    const idivc_result ref =
+      reference(consts, nslot, tstart + e*nslot, pmt + e*nslot);
+    if(same(ref, want[e])) continue;
+    if(!nbad++){
+      fprintf(stderr, "scalar kernel differs from the original on %s%s "
+              "events of %lu slots, first in event %d:\n",
+              sorted? "sorted ": "", kindnames[kind], (unsigned long)nslot, e);
+      printresult("original", ref);
+      printresult("scalar", want[e]);
+    }
+  }
+
+  for(int k = 0; k < idivc_kernel_count(); k++){
+    if(!idivc_kernel_supported(k)) continue;
+    const char * const name = idivc_kernel_name(k);
+    idivc_use_kernel(name);
+    idivc_process(consts, NEVENT, nslot, tstart, pmt, got);
+    int nbadhere = 0;
+    for(int e = 0; e < NEVENT; e++){
+      if(same(want[e], got[e])) continue;
+      if(!nbadhere++){
+        fprintf(stderr, "%s kernel differs on %s%s events of %lu slots, "
+                "first in event %d:\n", name, sorted? "sorted ": "",
+                kindnames[kind], (unsigned long)nslot, e);
+        printresult("scalar", want[e]);
+        printresult(name, got[e]);
+      }
+    }
+    nbad += nbadhere;
+  }
+  return nbad;
+}
+
+/* Checks idivc_candidates_redo() against the scalar kernel with the new
+constants on events of one kind, with some constants moved by up to
+maxmove either way. Returns the number of events that differ. */
+static int check_candidates(const event_kind kind, const bool sorted,
+                            const double maxmove, const idivc_consts * oldc,
+                            idivc_consts * const newc)
+{
+  for(int p = 0; p < IDIVC_NPMT; p++)
+    idivc_consts_set(newc, p, idivc_consts_get(oldc, p)
+                     + (randint(4)? 0: uniform(-maxmove, maxmove)));
+  double drop[IDIVC_NPMT];
+  idivc_consts_drop(oldc, newc, drop);
+
+  idivc_use_kernel("scalar");
+  int nbad = 0, nredo = 0;
+  for(int e = 0; e < NEVENT; e++){
+    double tstart[IDIVC_NSLOT];
+    short pmt[IDIVC_NSLOT];
+    make_event(kind, oldc, IDIVC_NSLOT, tstart, pmt);
+    if(sorted) sort_event(IDIVC_NSLOT, tstart, pmt);
+
+    idivc_candidates cand;
+    idivc_candidates_find(oldc, IDIVC_NSLOT, tstart, pmt, &cand);
+
+    idivc_result want, got;
+    idivc_process(newc, 1, IDIVC_NSLOT, tstart, pmt, &want);
+    if(idivc_candidates_redo(newc, drop, &cand, &got)) continue;
+    nredo++;
+    if(same(want, got)) continue;
+    if(!nbad++){
+      fprintf(stderr, "Candidates differ on %s%s events with constants "
+              "moved up to %g ns, first in event %d:\n",
+              sorted? "sorted ": "", kindnames[kind], maxmove, e);
+      printresult("scalar", want);
+      printresult("redo", got);
+    }
+  }
+
+  // If nothing could be redone, nothing was checked
+  if(!nredo){
+    fprintf(stderr, "No %s%s events could be redone from candidates with "
+            "constants moved up to %g ns\n", sorted? "sorted ": "",
+            kindnames[kind], maxmove);
+    nbad++;
+  }
+  return nbad;
+}
+
+/* Returns how many PMTs' constants differ between a and b */
+static int ndiffer(const idivc_consts * a, const idivc_consts * b)
+{
+  int n = 0;
+  for(int p = 0; p < IDIVC_NPMT; p++)
+    n += idivc_consts_get(a, p) != idivc_consts_get(b, p);
+  return n;
+}
+
+/* Checks that constants written as text read back exactly, and that a
+file with a bad line leaves the table as it was, still giving the same
+answers from every kernel. Returns the number of failures. */
+static int check_consts_text(const idivc_consts * consts,
+                             idivc_consts * const other)
+{
+  char name[] = "/tmp/idivc_check_XXXXXX";
+  const int fd = mkstemp(name);
+  if(fd < 0){
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  int nbad = 0;
+  set_random_consts(other);
+  if(idivc_consts_write(consts, name) || idivc_consts_read(other, name) ||
+     ndiffer(consts, other)){
+    fprintf(stderr, "Constants didn't read back the same from %s\n", name);
+    nbad++;
+  }
+
+  FILE * const f = fopen(name, "w");
+  fprintf(f, "%s\n1 5\n2 -30\nthree 7\n", IDIVC_CONSTS_MAGIC);
+  fclose(f);
+  set_random_consts(other);
+  for(int p = 0; p < IDIVC_NPMT; p++)
+    idivc_consts_set(other, p, idivc_consts_get(consts, p));
+  const int err = idivc_consts_read(other, name);
+  if(err != 4 || ndiffer(consts, other)){
+    fprintf(stderr, "Reading a bad line 4 gave %d and changed %d "
+            "constants\n", err, ndiffer(consts, other));
+    nbad++;
+  }
+  nbad += check_kernels(EV_RANDOM, true, IDIVC_NSLOT, other);
+
+  unlink(name);
+  return nbad;
+}
+
+// Roughly Gaussian, with mean 0 and the given rms
+static double gaussian(const double rms)
+{
+  double sum = 0;
+  for(int i = 0; i < 12; i++) sum += uniform(0, 1);
+  return rms*(sum - 6);
+}
+
+/* Checks that the summary counts what idivc_process() found, and that
+merging two adds them up. Returns the number of failures. */
+static int check_summary(const idivc_consts * consts)
+{
+  const size_t nslot = IDIVC_NSLOT;
+  double * const tstart = (double *)malloc(NEVENT*nslot*sizeof(double));
+  short * const pmt = (short *)malloc(NEVENT*nslot*sizeof(short));
+  idivc_result * const out =
+    (idivc_result *)malloc(NEVENT*sizeof(idivc_result));
+  idivc_summary * const sum = (idivc_summary *)malloc(sizeof(idivc_summary));
+  idivc_summary * const twice =
+    (idivc_summary *)malloc(sizeof(idivc_summary));
+
+  for(int e = 0; e < NEVENT; e++)
+    make_event(event_kind(randint(EV_NKIND)), consts, nslot,
+               tstart + e*nslot, pmt + e*nslot);
+  idivc_process(consts, NEVENT, nslot, tstart, pmt, out);
+
+  uint64_t nid = 0, niv = 0, nboth = 0;
+  for(int e = 0; e < NEVENT; e++){
+    nid += idivc_id_valid(&out[e]) != 0;
+    niv += idivc_iv_valid(&out[e]) != 0;
+    nboth += idivc_id_valid(&out[e]) && idivc_iv_valid(&out[e]);
+  }
+
+  idivc_summary_clear(sum);
+  idivc_summary_add(sum, out, NEVENT);
+  idivc_summary_clear(twice);
+  idivc_summary_merge(twice, sum);
+  idivc_summary_merge(twice, sum);
+
+  uint64_t nidhist = 0, nivhist = 0, ndiffhist = 0;
+  for(int b = 0; b < IDIVC_SUM_NTIMEBIN + 2; b++){
+    nidhist += sum->timeid[b];
+    nivhist += sum->timeiv[b];
+  }
+  for(int b = 0; b < IDIVC_SUM_NDIFFBIN + 2; b++)
+    ndiffhist += sum->timediff[b];
+
+  int nbad = 0;
+  if(sum->nevent != uint64_t(NEVENT) || sum->nidvalid != nid ||
+     sum->nivvalid != niv || sum->nbothvalid != nboth ||
+     nidhist != nid || nivhist != niv || ndiffhist != nboth){
+    fprintf(stderr, "Summary counted %lu events, %lu/%lu/%lu valid, "
+            "%lu/%lu/%lu in histograms, but there were %d, %lu/%lu/%lu\n",
+            (unsigned long)sum->nevent, (unsigned long)sum->nidvalid,
+            (unsigned long)sum->nivvalid, (unsigned long)sum->nbothvalid,
+            (unsigned long)nidhist, (unsigned long)nivhist,
+            (unsigned long)ndiffhist, NEVENT, (unsigned long)nid,
+            (unsigned long)niv, (unsigned long)nboth);
+    nbad++;
+  }
+  if(twice->nevent != 2*sum->nevent ||
+     twice->timediff[IDIVC_SUM_NDIFFBIN/2] !=
+     2*sum->timediff[IDIVC_SUM_NDIFFBIN/2]){
+    fprintf(stderr, "Merging a summary into itself didn't double it\n");
+    nbad++;
+  }
+
+  free(tstart);
+  free(pmt);
+  free(out);
+  free(sum);
+  free(twice);
+  return nbad;
+}
+
+/* Simulates PMTs with random timing offsets and checks that a few
+passes of suggested constants take them out, to well within the hit
+time jitter. Returns the number of failures. */
+static int check_residuals(idivc_consts * const consts,
+                           idivc_consts * const newc)
+{
+  // Few enough hits that each IV PMT is often first, which is where
+  // counting the first hit itself used to stop the constants converging
+  const int nhit = 100, npass = 5;
+  const double offsetrms = 3, jitter = 2, maxrms = 0.8;
+
+  double offset[IDIVC_NPMT];
+  for(int p = 0; p < IDIVC_NPMT; p++) offset[p] = gaussian(offsetrms);
+
+  const size_t nslot = nhit;
+  double * const tstart = (double *)malloc(NEVENT*nslot*sizeof(double));
+  short * const pmt = (short *)malloc(NEVENT*nslot*sizeof(short));
+  idivc_result * const out =
+    (idivc_result *)malloc(NEVENT*sizeof(idivc_result));
+  idivc_residuals * const res =
+    (idivc_residuals *)malloc(sizeof(idivc_residuals));
+
+  for(int e = 0; e < NEVENT; e++){
+    const double t = uniform(100, 200);
+    for(int i = 0; i < nhit; i++){
+      pmt[e*nslot + i] = randint(IDIVC_NPMT);
+      tstart[e*nslot + i] = t + offset[pmt[e*nslot + i]] + gaussian(jitter);
+    }
+  }
+
+  for(int p = 0; p < IDIVC_NPMT; p++) idivc_consts_set(consts, p, 0);
+
+  // What's left of each PMT's offset, less its detector's average, which
+  // the constants don't fix
+  double rms[2];
+  for(int pass = 0; pass <= npass; pass++){
+    for(int det = 0; det < 2; det++){
+      const int lo = det? IDIVC_NIDPMT: 0, hi = det? IDIVC_NPMT: IDIVC_NIDPMT;
+      double mean = 0, sumsq = 0;
+      for(int p = lo; p < hi; p++)
+        mean += offset[p] + idivc_consts_get(consts, p);
+      mean /= hi - lo;
+      for(int p = lo; p < hi; p++){
+        const double left = offset[p] + idivc_consts_get(consts, p) - mean;
+        sumsq += left*left;
+      }
+      rms[det] = sqrt(sumsq/(hi - lo));
+    }
+    if(pass == npass) break;
+
+    idivc_process(consts, NEVENT, nslot, tstart, pmt, out);
+    idivc_residuals_clear(res);
+    idivc_residuals_add(res, consts, NEVENT, nslot, tstart, pmt, out);
+    idivc_residuals_suggest(res, consts, newc);
+    for(int p = 0; p < IDIVC_NPMT; p++)
+      idivc_consts_set(consts, p, idivc_consts_get(newc, p));
+  }
+
+  int nbad = 0;
+  if(rms[0] > maxrms || rms[1] > maxrms){
+    fprintf(stderr, "After %d passes of residuals, the ID and IV offsets "
+            "are still %.2f and %.2f ns rms, more than %.2f\n", npass,
+            rms[0], rms[1], maxrms);
+    nbad++;
+  }
+
+  free(tstart);
+  free(pmt);
+  free(out);
+  free(res);
+  return nbad;
+}
+
+int main()
+{
+  idivc_consts * const consts = idivc_consts_new();
+  idivc_consts * const newc = idivc_consts_new();
+  if(!consts || !newc){
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  printf("Checking kernels:");
+  for(int k = 0; k < idivc_kernel_count(); k++)
+    if(idivc_kernel_supported(k)) printf(" %s", idivc_kernel_name(k));
+  printf("\n");
+
+  // Including a number of slots that isn't a multiple of any vector
+  // width, and more than the early kernel handles itself
+  const size_t nslots[] = { 61, IDIVC_NSLOT, 1000 };
+
+  int nbad = 0;
+  for(int pass = 0; pass < 2; pass++){
+    // All zeros, like Monte Carlo, then realistic constants
+    if(pass) set_random_consts(consts);
+    for(int kind = 0; kind < EV_NKIND; kind++)
+      for(int sorted = 0; sorted < 2; sorted++){
+        for(unsigned int s = 0; s < sizeof(nslots)/sizeof(nslots[0]); s++)
+          nbad += check_kernels(event_kind(kind), sorted, nslots[s], consts);
+        nbad += check_candidates(event_kind(kind), sorted, 1e-6, consts,
+                                 newc);
+        nbad += check_candidates(event_kind(kind), sorted, 0.5, consts,
+                                 newc);
+      }
+  }
+
+  nbad += check_consts_text(consts, newc);
+  nbad += check_summary(consts);
+  nbad += check_residuals(consts, newc);
+
+  idivc_consts_free(consts);
+  idivc_consts_free(newc);
+
+  if(nbad){
+    fprintf(stderr, "FAILED: %d events or checks went wrong\n", nbad);
+    return 1;
+  }
+  printf("All kernels and candidates agree with the scalar kernel, and it "
+         "with the original.\nText constants read back exactly, the "
+         "summary counts right and residuals find the constants.\n");
+  return 0;
+}
@@ -1,11 +1,8 @@
+#include "idivc_lib.h"
+
 struct idivc_input_event {
-  double tstart[520];
-  short pmt[520];
+  double tstart[IDIVC_NSLOT];
+  short pmt[IDIVC_NSLOT];
 };
 
-struct idivc_output_event {
-  float timeid;
-  float timeiv;
-  int firstidpmt;
-  int firstivpmt;
-};
+typedef idivc_result idivc_output_event;
@@ -0,0 +1,121 @@
+/**
+  \author Matthew Strait
+  \brief Records how long each event takes in each stage, to find the
+  rare slow ones that an average hides.
+
+  Histograms are bucketed like HdrHistogram: a linear bucket for each
+  nanosecond up to 16, then 16 buckets per power of two, which keeps
+  the error under about 6% and the whole thing small enough to stay in
+  the cache.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const int LAT_SUBBITS = 4;
+static const int LAT_SUB = 1 << LAT_SUBBITS;
+static const int LAT_NBUCKET = LAT_SUB * (64 - LAT_SUBBITS + 1);
+
+// How many of the slowest events to remember
+static const int LAT_NWORST = 5;
+
+struct latency_hist {
+  const char * name;
+  uint64_t counts[LAT_NBUCKET];
+  uint64_t n;
+
+  // Slowest times, slowest first, and which events they were
+  uint64_t worst[LAT_NWORST];
+  uint64_t worstevent[LAT_NWORST];
+};
+
+enum latency_stage { LAT_READ, LAT_COMPUTE, LAT_WRITE, LAT_NSTAGE };
+
+static latency_hist latencies[LAT_NSTAGE];
+
+static inline uint64_t latency_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return uint64_t(t.tv_sec)*1000000000 + t.tv_nsec;
+}
+
+static inline int latency_bucket(const uint64_t ns)
+{
+  if(ns < uint64_t(LAT_SUB)) return ns;
+  const int msb = 63 - __builtin_clzll(ns);
+  const int shift = msb - LAT_SUBBITS;
+  return LAT_SUB*(shift+1) + int(ns >> shift) - LAT_SUB;
+}
+
+// Smallest time that goes in a bucket
+static uint64_t latency_bucket_low(const int b)
+{
+  if(b < LAT_SUB) return b;
+  const int shift = b/LAT_SUB - 1;
+  return uint64_t(b%LAT_SUB + LAT_SUB) << shift;
+}
+
+static void initlatency()
+{
+  const char * const names[LAT_NSTAGE] = { "read", "compute", "write" };
+  memset(latencies, 0, sizeof(latencies));
+  for(int s = 0; s < LAT_NSTAGE; s++) latencies[s].name = names[s];
+}
+
+static void latency_noteworst(latency_hist & h, const uint64_t ns,
+                              const uint64_t event)
+{
+  int i = LAT_NWORST-1;
+  for(; i > 0 && ns > h.worst[i-1]; i--){
+    h.worst[i] = h.worst[i-1];
+    h.worstevent[i] = h.worstevent[i-1];
+  }
+  h.worst[i] = ns;
+  h.worstevent[i] = event;
+}
+
+/* Record that the given stage took ns nanoseconds for this event. */
+static inline void latency_record(const latency_stage stage,
+                                  const uint64_t ns, const uint64_t event)
+{
+  latency_hist & h = latencies[stage];
+  h.counts[latency_bucket(ns)]++;
+  h.n++;
+  if(ns > h.worst[LAT_NWORST-1]) latency_noteworst(h, ns, event);
+}
+
+// The upper edge of the bucket holding the given fraction of times, or
+// the slowest time if that is less
+static double latency_quantile_us(const latency_hist & h, const double q)
+{
+  const uint64_t target = uint64_t(q*h.n + 0.5);
+  uint64_t sofar = 0;
+  for(int b = 0; b < LAT_NBUCKET; b++){
+    sofar += h.counts[b];
+    if(sofar >= target && sofar){
+      const uint64_t edge = latency_bucket_low(b+1);
+      return (edge < h.worst[0]? edge: h.worst[0])*1e-3;
+    }
+  }
+  return h.worst[0]*1e-3;
+}
+
+static void printlatency()
+{
+  printf("Per-event latency (us):\n"
+         "%8s %10s %10s %10s %10s  slowest events\n",
+         "stage", "p50", "p99", "p99.9", "max");
+  for(int s = 0; s < LAT_NSTAGE; s++){
+    const latency_hist & h = latencies[s];
+    if(!h.n) continue;
+    printf("%8s %10.2f %10.2f %10.2f %10.2f ", h.name,
+           latency_quantile_us(h, 0.5), latency_quantile_us(h, 0.99),
+           latency_quantile_us(h, 0.999), h.worst[0]*1e-3);
+    for(int i = 0; i < LAT_NWORST && i < int(h.n); i++)
+      printf(" %lu", (unsigned long)h.worstevent[i]);
+    printf("\n");
+  }
+}
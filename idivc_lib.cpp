@@ -0,0 +1,851 @@
+/**
+  \author Matthew Strait
+  \brief The timing constants and the time correction itself, with a C
+  interface so that it can be used without ROOT or the idivc program.
+*/
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include "idivc_lib.h"
+
+struct idivc_consts {
+  double t0[IDIVC_NPMT];
+
+  // Smallest constant in each detector, for the early exit kernel
+  double minid, miniv;
+};
+
+static void consts_update_min(idivc_consts * const consts)
+{
+  consts->minid = consts->miniv = 1e30;
+  for(int p = 0; p < IDIVC_NPMT; p++){
+    double & m = p < IDIVC_NIDPMT? consts->minid: consts->miniv;
+    if(consts->t0[p] < m) m = consts->t0[p];
+  }
+}
+
+int idivc_abi_version(void)
+{
+  return IDIVC_ABI_VERSION;
+}
+
+idivc_consts * idivc_consts_new(void)
+{
+  idivc_consts * const consts = (idivc_consts *)malloc(sizeof(idivc_consts));
+  if(consts) memset(consts, 0, sizeof(idivc_consts));
+  return consts;
+}
+
+void idivc_consts_free(idivc_consts * consts)
+{
+  free(consts);
+}
+
+int idivc_consts_add_fit(idivc_consts * consts, const double pmt,
+                         const double time, const double timee)
+{
+  // means tube wasn't fit, probably because it was powered off
+  if(time == 0 || timee == 0 || timee == 1) return IDIVC_FIT_UNFIT;
+
+  // Very few hits in this run?  Shouldn't really happen.
+  if(timee > 1) return IDIVC_FIT_BADERROR;
+
+  if(pmt < 0 || pmt >= IDIVC_NPMT) return IDIVC_FIT_BADPMT;
+
+  consts->t0[int(pmt)] = time;
+  consts_update_min(consts);
+  return IDIVC_FIT_USED;
+}
+
+int idivc_consts_set(idivc_consts * consts, const int pmt, const double time)
+{
+  if(pmt < 0 || pmt >= IDIVC_NPMT) return -1;
+  consts->t0[pmt] = time;
+  consts_update_min(consts);
+  return 0;
+}
+
+double idivc_consts_get(const idivc_consts * consts, const int pmt)
+{
+  if(pmt < 0 || pmt >= IDIVC_NPMT) return 0;
+  return consts->t0[pmt];
+}
+
+int idivc_consts_read(idivc_consts * consts, const char * const filename)
+{
+  FILE * const f = fopen(filename, "r");
+  if(!f) return IDIVC_READ_NOFILE;
+
+  char line[1024];
+  if(!fgets(line, sizeof(line), f) ||
+     strncmp(line, IDIVC_CONSTS_MAGIC, strlen(IDIVC_CONSTS_MAGIC))){
+    fclose(f);
+    return IDIVC_READ_NOTTEXT;
+  }
+
+  // Only touch consts once the whole file has been understood
+  double t0[IDIVC_NPMT] = { 0 };
+
+  int lineno = 1;
+  while(fgets(line, sizeof(line), f)){
+    lineno++;
+    const char * p = line + strspn(line, " \t");
+    if(*p == '#' || *p == '\n' || *p == '\0') continue;
+
+    int pmt;
+    double time;
+    char extra;
+    if(sscanf(p, "%d %lf %c", &pmt, &time, &extra) != 2 ||
+       pmt < 0 || pmt >= IDIVC_NPMT){
+      fclose(f);
+      return lineno;
+    }
+    t0[pmt] = time;
+  }
+
+  fclose(f);
+  memcpy(consts->t0, t0, sizeof(t0));
+  consts_update_min(consts);
+  return 0;
+}
+
+int idivc_consts_write(const idivc_consts * consts,
+                       const char * const filename)
+{
+  FILE * const f = fopen(filename, "w");
+  if(!f) return -1;
+
+  // 17 digits is enough to read back exactly the same double
+  fprintf(f, "%s\n", IDIVC_CONSTS_MAGIC);
+  for(int p = 0; p < IDIVC_NPMT; p++)
+    if(consts->t0[p] != 0) fprintf(f, "%d %.17g\n", p, consts->t0[p]);
+
+  const bool bad = ferror(f);
+  return fclose(f) || bad? -1: 0;
+}
+
+/* The original, straightforward version. Finds the first hit in each
+detector in one pass, in slot order. Everything else must give exactly
+the same answer as this, including which PMT wins ties. */
+static inline __attribute__((always_inline))
+void doit(idivc_result & out, const double * const tstart,
+          const short * const pmt, const size_t nslot,
+          const double * const fido_consts)
+{
+  out.timeid = out.timeiv = 9999;
+  out.firstidpmt = out.firstivpmt = -1;
+
+  for(size_t i = 0; i < nslot; i++){
+    if(pmt[i] < 0 || pmt[i] >= IDIVC_NPMT) continue;
+
+    const double time = tstart[i] + fido_consts[pmt[i]];
+
+    if(tstart[i] <= 0) continue;
+
+    if(pmt[i] < IDIVC_NIDPMT){
+      if(time < out.timeid){
+        out.timeid = time;
+        out.firstidpmt = pmt[i];
+      }
+    }
+    else{
+      if(time < out.timeiv){
+        out.timeiv = time;
+        out.firstivpmt = pmt[i];
+      }
+    }
+  }
+
+  // A first hit after 999 ns keeps its PMT, as it always has, but its
+  // time is reported as -1 and it isn't valid
+  out.valid = 0;
+  if(out.timeiv > 999) out.timeiv = -1;
+  else if(out.firstivpmt >= 0) out.valid |= IDIVC_VALID_IV;
+  if(out.timeid > 999) out.timeid = -1;
+  else if(out.firstidpmt >= 0) out.valid |= IDIVC_VALID_ID;
+}
+
+/* The same as doit(), but arranged so that the compiler can vectorize
+it. The first pass is a branch-free minimum over all slots. Since the
+running best time in doit() is stored as a float, the winner is not
+always the hit with the smallest time, but the only hits that can
+matter are those that round to the same float as the smallest. The
+second pass counts those and finds the last of them. If there is just
+one, as is nearly always true, it is the answer. Otherwise, fall back
+to doit(). */
+static inline __attribute__((always_inline))
+void doit_twopass(idivc_result & out, const double * const tstart,
+                  const short * const pmt, const size_t nslot,
+                  const double * const fido_consts)
+{
+  const double never = 1e30;
+  double minid = never, miniv = never;
+
+  // Bitwise operators instead of && and ?: for the index, or else GCC
+  // sees control flow and won't vectorize.
+  for(size_t i = 0; i < nslot; i++){
+    const int p = pmt[i];
+    const bool known = (unsigned int)p < IDIVC_NPMT;
+    const double time = tstart[i] + fido_consts[p & -int(known)];
+    const bool good = known & (tstart[i] > 0);
+    const double tid = (good & (p <  IDIVC_NIDPMT))? time: never;
+    const double tiv = (good & (p >= IDIVC_NIDPMT))? time: never;
+    minid = tid < minid? tid: minid;
+    miniv = tiv < miniv? tiv: miniv;
+  }
+
+  // Every time that rounds to the same float as the minimum is below
+  // these. A few others may be too, which only costs a trip through
+  // doit(). Not nextafterf(), which gives a denormal near zero, and
+  // -ffast-math flushes those to zero.
+  const double idbound = minid + fabs(minid)*0x1p-22 + FLT_MIN;
+  const double ivbound = miniv + fabs(miniv)*0x1p-22 + FLT_MIN;
+
+  // Max of the slot number instead of remembering the last one found,
+  // again so that GCC will vectorize.
+  int nid = 0, niv = 0, lastid = -1, lastiv = -1;
+  for(int i = 0; i < int(nslot); i++){
+    const int p = pmt[i];
+    const bool known = (unsigned int)p < IDIVC_NPMT;
+    const double time = tstart[i] + fido_consts[p & -int(known)];
+    const bool good = known & (tstart[i] > 0);
+    const bool isid = good & (p <  IDIVC_NIDPMT) & (time < idbound);
+    const bool isiv = good & (p >= IDIVC_NIDPMT) & (time < ivbound);
+    nid += isid;
+    niv += isiv;
+    const int slotid = isid? i: -1, slotiv = isiv? i: -1;
+    lastid = slotid > lastid? slotid: lastid;
+    lastiv = slotiv > lastiv? slotiv: lastiv;
+  }
+
+  if(nid > 1 || niv > 1){
+    doit(out, tstart, pmt, nslot, fido_consts);
+    return;
+  }
+
+  out.timeid = out.timeiv = 9999;
+  out.firstidpmt = out.firstivpmt = -1;
+
+  if(nid == 1 && minid < 9999){
+    out.timeid = minid;
+    out.firstidpmt = pmt[lastid];
+  }
+  if(niv == 1 && miniv < 9999){
+    out.timeiv = miniv;
+    out.firstivpmt = pmt[lastiv];
+  }
+
+  // As in doit()
+  out.valid = 0;
+  if(out.timeiv > 999) out.timeiv = -1;
+  else if(out.firstivpmt >= 0) out.valid |= IDIVC_VALID_IV;
+  if(out.timeid > 999) out.timeid = -1;
+  else if(out.firstidpmt >= 0) out.valid |= IDIVC_VALID_ID;
+}
+
+// Only hits below this can be first if the earliest time is t. See
+// doit_twopass().
+static inline double firstbound(const double t)
+{
+  return t + fabs(t)*0x1p-22 + FLT_MIN;
+}
+
+// Number of time buckets that doit_early() sorts hits into if they
+// aren't in time order already
+static const int EARLY_NBUCKET = 32;
+
+/* Finds the first hits from those in slots [0, nslot) sorted into coarse
+buckets of raw time, looking at buckets in order and stopping in each
+detector once no later bucket can have a hit before the bound for the
+earliest corrected time so far. Then does doit() on just the hits
+looked at, which gives the same answer as on all of them. */
+static void doit_buckets(idivc_result & out, const double * const tstart,
+                         const short * const pmt, const size_t nslot,
+                         const idivc_consts * const consts)
+{
+  const double * const fido_consts = consts->t0;
+
+  double lo = 1e30, hi = -1e30;
+  for(size_t i = 0; i < nslot; i++){
+    if(pmt[i] < 0 || pmt[i] >= IDIVC_NPMT || tstart[i] <= 0) continue;
+    if(tstart[i] < lo) lo = tstart[i];
+    if(tstart[i] > hi) hi = tstart[i];
+  }
+  const double perbucket = hi > lo? EARLY_NBUCKET/(hi - lo): 0;
+  const double width = (hi - lo)/EARLY_NBUCKET;
+
+  // A counting sort on the bucket number
+  unsigned char bucket[IDIVC_NSLOT];
+  int count[EARLY_NBUCKET] = { 0 };
+  for(size_t i = 0; i < nslot; i++){
+    if(pmt[i] < 0 || pmt[i] >= IDIVC_NPMT || tstart[i] <= 0) continue;
+    int b = int((tstart[i] - lo)*perbucket);
+    if(b >= EARLY_NBUCKET) b = EARLY_NBUCKET-1;
+    bucket[i] = b;
+    count[b]++;
+  }
+  int start[EARLY_NBUCKET+1];
+  start[0] = 0;
+  for(int b = 0; b < EARLY_NBUCKET; b++) start[b+1] = start[b] + count[b];
+  int order[IDIVC_NSLOT], pos[EARLY_NBUCKET];
+  memcpy(pos, start, sizeof(pos));
+  for(size_t i = 0; i < nslot; i++)
+    if(pmt[i] >= 0 && pmt[i] < IDIVC_NPMT && tstart[i] > 0)
+      order[pos[bucket[i]]++] = i;
+
+  // A hit is only known to be after the start of the bucket before its
+  // own, to allow for rounding in the bucket number.
+  double minid = 1e30, miniv = 1e30;
+  bool doneid = false, doneiv = false;
+  bool look[IDIVC_NSLOT] = { false };
+  for(int b = 0; b < EARLY_NBUCKET && !(doneid && doneiv); b++){
+    const double earliest = lo + (b - 1)*width;
+    doneid |= earliest + consts->minid >= firstbound(minid);
+    doneiv |= earliest + consts->miniv >= firstbound(miniv);
+    for(int j = start[b]; j < start[b+1]; j++){
+      const int i = order[j];
+      const bool isid = pmt[i] < IDIVC_NIDPMT;
+      if(isid? doneid: doneiv) continue;
+      const double time = tstart[i] + fido_consts[pmt[i]];
+      double & m = isid? minid: miniv;
+      if(time < m) m = time;
+      look[i] = true;
+    }
+  }
+
+  double ctstart[IDIVC_NSLOT];
+  short cpmt[IDIVC_NSLOT];
+  int n = 0;
+  for(size_t i = 0; i < nslot; i++){
+    if(!look[i]) continue;
+    ctstart[n] = tstart[i];
+    cpmt[n] = pmt[i];
+    n++;
+  }
+  doit(out, ctstart, cpmt, n, fido_consts);
+}
+
+/* The same as doit(), but stopping early. Hits are looked at in slot
+order, and each detector is finished once one of its hits has a raw time
+plus the smallest constant past the bound for its earliest corrected
+time so far. A detector with no hits yet counts as finished too, so
+that events with hits in only one detector can stop early. If the hits
+are in time order, no later hit can matter, and doit() on the slots
+before the stop gives the same answer as on all of them. That they are
+in order enough is checked with a quick pass over the rest of the raw
+times. If a detector that had no hits turns out to have some later,
+carry on looking for them. If hits are out of order, fall back to
+sorting them into buckets of time. */
+static void doit_early(idivc_result & out, const double * const tstart,
+                       const short * const pmt, const size_t nslot,
+                       const idivc_consts * const consts)
+{
+  const double * const fido_consts = consts->t0;
+  if(nslot > IDIVC_NSLOT){
+    doit(out, tstart, pmt, nslot, fido_consts);
+    return;
+  }
+
+  // Indexed by detector, ID then IV
+  const double never = 1e30;
+  const double mincon[2] = { consts->minid, consts->miniv };
+  double best[2] = { never, never };
+  bool done[2] = { false, false };
+
+  // Whether a detector is known to have hits, even if none so far
+  bool hashits[2] = { false, false };
+
+  size_t stop = 0;
+  while(true){
+    for(; stop < nslot; stop++){
+      const int p = pmt[stop];
+      if(p < 0 || p >= IDIVC_NPMT || tstart[stop] <= 0) continue;
+      const int d = p >= IDIVC_NIDPMT;
+      if(done[d]) continue;
+      if(tstart[stop] + mincon[d] >= firstbound(best[d])){
+        done[d] = true;
+        if((done[0] || (best[0] == never && !hashits[0])) &&
+           (done[1] || (best[1] == never && !hashits[1]))) break;
+        continue;
+      }
+      const double time = tstart[stop] + fido_consts[p];
+      if(time < best[d]) best[d] = time;
+    }
+
+    if(stop == nslot){
+      doit(out, tstart, pmt, nslot, fido_consts);
+      return;
+    }
+
+    // Earliest raw time left in each detector. Written like
+    // doit_twopass() so that it vectorizes.
+    double restid = never, restiv = never;
+    for(size_t i = stop; i < nslot; i++){
+      const int p = pmt[i];
+      const bool good = ((unsigned int)p < IDIVC_NPMT) & (tstart[i] > 0);
+      const double tid = (good & (p <  IDIVC_NIDPMT))? tstart[i]: never;
+      const double tiv = (good & (p >= IDIVC_NIDPMT))? tstart[i]: never;
+      restid = tid < restid? tid: restid;
+      restiv = tiv < restiv? tiv: restiv;
+    }
+    const double rest[2] = { restid, restiv };
+
+    bool outoforder = false, more = false;
+    for(int d = 0; d < 2; d++){
+      if(rest[d] == never) continue;
+      if(done[d]){
+        outoforder |= rest[d] + mincon[d] < firstbound(best[d]);
+      }
+      else{
+        // No hits in this detector before the stop, but some after it
+        hashits[d] = more = true;
+      }
+    }
+
+    if(outoforder){
+      doit_buckets(out, tstart, pmt, nslot, consts);
+      return;
+    }
+    if(!more){
+      doit(out, tstart, pmt, stop, fido_consts);
+      return;
+    }
+  }
+}
+
+typedef void (*kernel_fn)(const idivc_consts * consts, size_t nevent,
+                          size_t nslot, const double * tstart,
+                          const short * pmt, idivc_result * out);
+
+static void kernel_scalar(const idivc_consts * const consts,
+                          const size_t nevent, const size_t nslot,
+                          const double * tstart, const short * pmt,
+                          idivc_result * out)
+{
+  for(size_t i = 0; i < nevent; i++)
+    doit(out[i], tstart + i*nslot, pmt + i*nslot, nslot, consts->t0);
+}
+
+static void kernel_early(const idivc_consts * const consts,
+                         const size_t nevent, const size_t nslot,
+                         const double * tstart, const short * pmt,
+                         idivc_result * out)
+{
+  for(size_t i = 0; i < nevent; i++)
+    doit_early(out[i], tstart + i*nslot, pmt + i*nslot, nslot, consts);
+}
+
+// The same source compiled for each instruction set. Which one the
+// compiler does best with varies, so they can also be timed against
+// each other with idivc_autotune().
+#if defined(__x86_64__) || defined(__i386__)
+  #define IDIVC_X86_KERNEL(name, isa) \
+    __attribute__((target(isa))) \
+    static void name(const idivc_consts * const consts, \
+                     const size_t nevent, const size_t nslot, \
+                     const double * tstart, const short * pmt, \
+                     idivc_result * out) \
+    { \
+      for(size_t i = 0; i < nevent; i++) \
+        doit_twopass(out[i], tstart + i*nslot, pmt + i*nslot, nslot, \
+                     consts->t0); \
+    }
+
+  IDIVC_X86_KERNEL(kernel_sse42, "sse4.2")
+  IDIVC_X86_KERNEL(kernel_avx2, "avx2")
+  IDIVC_X86_KERNEL(kernel_avx512, "avx512f,avx512bw,avx512vl,avx512dq")
+#endif
+
+struct kernel {
+  const char * name;
+  kernel_fn fn;
+};
+
+// In order of preference, worst first. The early exit kernel is only
+// better for events with many hits, so it is never the default, but
+// idivc_autotune() may pick it.
+static const kernel kernels[] = {
+  { "scalar", kernel_scalar },
+  { "early",  kernel_early },
+#if defined(__x86_64__) || defined(__i386__)
+  { "sse4.2", kernel_sse42 },
+  { "avx2",   kernel_avx2 },
+  { "avx512", kernel_avx512 },
+#endif
+};
+
+static const int nkernel = sizeof(kernels)/sizeof(kernels[0]);
+
+// The kernel in use, or -1 if not chosen yet. Other threads may be
+// running idivc_process() while this is set, so it is only ever read and
+// written atomically, and only ever holds a kernel this CPU can run.
+static int curkernel = -1;
+
+int idivc_kernel_count(void)
+{
+  return nkernel;
+}
+
+const char * idivc_kernel_name(const int k)
+{
+  if(k < 0 || k >= nkernel) return NULL;
+  return kernels[k].name;
+}
+
+int idivc_kernel_supported(const int k)
+{
+  if(k < 0 || k >= nkernel) return 0;
+  if(!strcmp(kernels[k].name, "scalar") ||
+     !strcmp(kernels[k].name, "early")) return 1;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(!strcmp(kernels[k].name, "sse4.2"))
+    return __builtin_cpu_supports("sse4.2");
+  if(!strcmp(kernels[k].name, "avx2"))
+    return __builtin_cpu_supports("avx2");
+  if(!strcmp(kernels[k].name, "avx512"))
+    return __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512vl")
+        && __builtin_cpu_supports("avx512dq");
+#endif
+  return 0;
+}
+
+int idivc_use_kernel(const char * const name)
+{
+  for(int k = 0; k < nkernel; k++){
+    if(strcmp(kernels[k].name, name)) continue;
+    if(!idivc_kernel_supported(k)) return -1;
+    __atomic_store_n(&curkernel, k, __ATOMIC_RELEASE);
+    return 0;
+  }
+  return -1;
+}
+
+static int best_kernel(void)
+{
+  int k;
+  for(k = nkernel-1; k > 0; k--)
+    if(idivc_kernel_supported(k) && strcmp(kernels[k].name, "early")) break;
+  return k;
+}
+
+void idivc_use_best_kernel(void)
+{
+  __atomic_store_n(&curkernel, best_kernel(), __ATOMIC_RELEASE);
+}
+
+// The kernel in use, choosing the best one if none has been chosen yet.
+// If several threads get here at once, they all pick the same kernel,
+// and a choice made meanwhile by idivc_use_kernel() is not overwritten.
+static int current_kernel(void)
+{
+  int k = __atomic_load_n(&curkernel, __ATOMIC_ACQUIRE);
+  if(k >= 0) return k;
+
+  const int best = best_kernel();
+  if(__atomic_compare_exchange_n(&curkernel, &k, best, false,
+                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return best;
+  return k;
+}
+
+const char * idivc_current_kernel(void)
+{
+  return kernels[current_kernel()].name;
+}
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+const char * idivc_autotune(const idivc_consts * consts, const size_t nevent,
+                            const size_t nslot, const double * tstart,
+                            const short * pmt, idivc_result * out)
+{
+  // Take the best of several tries to get rid of noise from interrupts
+  // and the like. The first try also warms up the caches.
+  const int ntry = 5;
+
+  double besttime = 1e30;
+  int best = current_kernel();
+  for(int k = 0; k < nkernel; k++){
+    if(!idivc_kernel_supported(k)) continue;
+    for(int t = 0; t < ntry; t++){
+      const double start = now();
+      kernels[k].fn(consts, nevent, nslot, tstart, pmt, out);
+      const double took = now() - start;
+      if(took < besttime){
+        besttime = took;
+        best = k;
+      }
+    }
+  }
+
+  __atomic_store_n(&curkernel, best, __ATOMIC_RELEASE);
+  return kernels[best].name;
+}
+
+void idivc_process(const idivc_consts * consts, const size_t nevent,
+                   const size_t nslot, const double * tstart,
+                   const short * pmt, idivc_result * out)
+{
+  kernels[current_kernel()].fn(consts, nevent, nslot, tstart, pmt, out);
+}
+
+void idivc_summary_clear(idivc_summary * sum)
+{
+  memset(sum, 0, sizeof(idivc_summary));
+}
+
+/* Bin number, counting the underflow as 0, as in ROOT */
+static inline int sumbin(const double x, const int nbin, const double lo,
+                         const double hi)
+{
+  if(x < lo) return 0;
+  if(x >= hi) return nbin+1;
+  return 1 + int((x - lo)*nbin/(hi - lo));
+}
+
+void idivc_summary_add(idivc_summary * sum, const idivc_result * out,
+                       const size_t nevent)
+{
+  for(size_t i = 0; i < nevent; i++){
+    const idivc_result & o = out[i];
+    const bool idvalid = idivc_id_valid(&o), ivvalid = idivc_iv_valid(&o);
+
+    sum->nevent++;
+    if(idvalid){
+      sum->nidvalid++;
+      sum->timeid[sumbin(o.timeid, IDIVC_SUM_NTIMEBIN,
+                         IDIVC_SUM_TIMELO, IDIVC_SUM_TIMEHI)]++;
+    }
+    if(ivvalid){
+      sum->nivvalid++;
+      sum->timeiv[sumbin(o.timeiv, IDIVC_SUM_NTIMEBIN,
+                         IDIVC_SUM_TIMELO, IDIVC_SUM_TIMEHI)]++;
+    }
+    if(idvalid && ivvalid){
+      sum->nbothvalid++;
+      sum->timediff[sumbin(o.timeid - o.timeiv, IDIVC_SUM_NDIFFBIN,
+                           IDIVC_SUM_DIFFLO, IDIVC_SUM_DIFFHI)]++;
+    }
+    if(o.firstidpmt >= 0 && o.firstidpmt < IDIVC_NPMT)
+      sum->firstidpmt[o.firstidpmt]++;
+    if(o.firstivpmt >= 0 && o.firstivpmt < IDIVC_NPMT)
+      sum->firstivpmt[o.firstivpmt]++;
+  }
+}
+
+void idivc_summary_merge(idivc_summary * into, const idivc_summary * from)
+{
+  // It's all uint64_t, so just add it up as an array
+  uint64_t * const a = (uint64_t *)into;
+  const uint64_t * const b = (const uint64_t *)from;
+  for(size_t i = 0; i < sizeof(idivc_summary)/sizeof(uint64_t); i++)
+    a[i] += b[i];
+}
+
+// Keeps times[0..n-1] as the n smallest seen so far, in order
+static inline void keep_smallest(double * const times, int & n,
+                                 const int max, const double t)
+{
+  if(n == max && t >= times[n-1]) return;
+  int i = n < max? n++: n-1;
+  for(; i > 0 && times[i-1] > t; i--) times[i] = times[i-1];
+  times[i] = t;
+}
+
+void idivc_candidates_find(const idivc_consts * consts, const size_t nslot,
+                           const double * tstart, const short * pmt,
+                           idivc_candidates * cand)
+{
+  const double never = 1e30;
+
+  // The IDIVC_NCAND+1 smallest times in each detector. The last, if
+  // there are that many, is the limit: everything below it is kept.
+  double id[IDIVC_NCAND+1], iv[IDIVC_NCAND+1];
+  int nid = 0, niv = 0;
+  for(size_t i = 0; i < nslot; i++){
+    if(pmt[i] < 0 || pmt[i] >= IDIVC_NPMT || tstart[i] <= 0) continue;
+    const double time = tstart[i] + consts->t0[pmt[i]];
+    if(pmt[i] < IDIVC_NIDPMT) keep_smallest(id, nid, IDIVC_NCAND+1, time);
+    else                      keep_smallest(iv, niv, IDIVC_NCAND+1, time);
+  }
+
+  cand->limitid = nid > IDIVC_NCAND? id[IDIVC_NCAND]: never;
+  cand->limitiv = niv > IDIVC_NCAND? iv[IDIVC_NCAND]: never;
+
+  cand->n = 0;
+  memset(cand->leftout, 0, sizeof(cand->leftout));
+  for(size_t i = 0; i < nslot; i++){
+    if(pmt[i] < 0 || pmt[i] >= IDIVC_NPMT || tstart[i] <= 0) continue;
+    const double time = tstart[i] + consts->t0[pmt[i]];
+    if(time >= (pmt[i] < IDIVC_NIDPMT? cand->limitid: cand->limitiv)){
+      cand->leftout[pmt[i]/8] |= 1 << (pmt[i]%8);
+      continue;
+    }
+    cand->tstart[cand->n] = tstart[i];
+    cand->pmt[cand->n] = pmt[i];
+    cand->n++;
+  }
+}
+
+void idivc_consts_drop(const idivc_consts * oldc, const idivc_consts * newc,
+                       double * drop)
+{
+  for(int p = 0; p < IDIVC_NPMT; p++) drop[p] = oldc->t0[p] - newc->t0[p];
+}
+
+// Whether a left-out hit might be first. As in doit_twopass(), only
+// hits below the bound can matter. Allow a little for rounding in the
+// times that limit was made from.
+static inline bool leftout_matters(const double best, const double limit,
+                                   const double drop)
+{
+  if(limit >= 1e30) return false;
+  const double bound = best + fabs(best)*0x1p-22 + FLT_MIN;
+  return bound >= limit - drop - 1e-6*(1 + fabs(limit));
+}
+
+int idivc_candidates_redo(const idivc_consts * newc,
+                          const double * const drop,
+                          const idivc_candidates * cand, idivc_result * out)
+{
+  // Doing the candidates alone gives the same answer as the whole event
+  // when every hit left out is after the bound in each detector.
+  doit(*out, cand->tstart, cand->pmt, cand->n, newc->t0);
+
+  // doit() reports times over 999 as -1, but they still count here.
+  // Find the minimum again rather than trust that.
+  double minid = 1e30, miniv = 1e30;
+  for(int i = 0; i < cand->n; i++){
+    const double time = cand->tstart[i] + newc->t0[cand->pmt[i]];
+    double & m = cand->pmt[i] < IDIVC_NIDPMT? minid: miniv;
+    if(time < m) m = time;
+  }
+
+  // The most that any left-out hit can have moved earlier
+  double dropid = -1e30, dropiv = -1e30;
+  for(int b = 0; b < IDIVC_PMTMASK; b++){
+    if(!cand->leftout[b]) continue;
+    for(int p = 8*b; p < 8*b + 8 && p < IDIVC_NPMT; p++){
+      if(!(cand->leftout[b] & (1 << (p%8)))) continue;
+      double & d = p < IDIVC_NIDPMT? dropid: dropiv;
+      if(drop[p] > d) d = drop[p];
+    }
+  }
+
+  if(leftout_matters(minid, cand->limitid, dropid) ||
+     leftout_matters(miniv, cand->limitiv, dropiv))
+    return -1;
+  return 0;
+}
+
+void idivc_residuals_clear(idivc_residuals * res)
+{
+  memset(res, 0, sizeof(idivc_residuals));
+}
+
+void idivc_residuals_add(idivc_residuals * res, const idivc_consts * consts,
+                         const size_t nevent, const size_t nslot,
+                         const double * tstart, const short * pmt,
+                         const idivc_result * out)
+{
+  for(size_t e = 0; e < nevent; e++){
+    const double * const t = tstart + e*nslot;
+    const short * const p = pmt + e*nslot;
+
+    // The first hit in each detector is left out, since its residual is
+    // zero by definition, and would make a spike that hides the real
+    // peak of PMTs that are often first. It is the earliest slot with
+    // the winning PMT and time, as doit() keeps the earliest of ties.
+    bool skippedid = false, skippediv = false;
+    for(size_t i = 0; i < nslot; i++){
+      if(p[i] < 0 || p[i] >= IDIVC_NPMT || t[i] <= 0) continue;
+      const bool id = p[i] < IDIVC_NIDPMT;
+      if(id? !idivc_id_valid(&out[e]): !idivc_iv_valid(&out[e])) continue;
+      const float first = id? out[e].timeid: out[e].timeiv;
+      const double time = t[i] + consts->t0[p[i]];
+      bool & skipped = id? skippedid: skippediv;
+      if(!skipped && p[i] == (id? out[e].firstidpmt: out[e].firstivpmt) &&
+         float(time) == first){
+        skipped = true;
+        continue;
+      }
+      res->counts[p[i]][sumbin(time - first, IDIVC_RES_NBIN, IDIVC_RES_LO,
+                               IDIVC_RES_HI)]++;
+    }
+  }
+}
+
+void idivc_residuals_merge(idivc_residuals * into,
+                           const idivc_residuals * from)
+{
+  uint64_t * const a = &into->counts[0][0];
+  const uint64_t * const b = &from->counts[0][0];
+  for(size_t i = 0; i < sizeof(idivc_residuals)/sizeof(uint64_t); i++)
+    a[i] += b[i];
+}
+
+// Where the residuals of one PMT peak, from the fullest bin and its
+// neighbours, or a huge number if there are too few of them
+static double residual_peak(const uint64_t * const counts)
+{
+  uint64_t total = 0;
+  int best = 1;
+  for(int b = 1; b <= IDIVC_RES_NBIN; b++){
+    total += counts[b];
+    if(counts[b] > counts[best]) best = b;
+  }
+  if(total < IDIVC_RES_MINCOUNT) return 1e30;
+
+  const double width = double(IDIVC_RES_HI - IDIVC_RES_LO)/IDIVC_RES_NBIN;
+  double sum = 0, weight = 0;
+  for(int b = best-1; b <= best+1; b++){
+    if(b < 1 || b > IDIVC_RES_NBIN) continue;
+    sum += counts[b]*(IDIVC_RES_LO + (b - 0.5)*width);
+    weight += counts[b];
+  }
+  return sum/weight;
+}
+
+int idivc_residuals_suggest(const idivc_residuals * res,
+                            const idivc_consts * consts,
+                            idivc_consts * suggested)
+{
+  *suggested = *consts;
+
+  double peak[IDIVC_NPMT];
+  for(int p = 0; p < IDIVC_NPMT; p++) peak[p] = residual_peak(res->counts[p]);
+
+  int nchanged = 0;
+  for(int det = 0; det < 2; det++){
+    const int lo = det? IDIVC_NIDPMT: 0, hi = det? IDIVC_NPMT: IDIVC_NIDPMT;
+
+    double peaks[IDIVC_NPMT];
+    int n = 0;
+    for(int p = lo; p < hi; p++) if(peak[p] < 1e30) peaks[n++] = peak[p];
+    if(!n) continue;
+    std::nth_element(peaks, peaks + n/2, peaks + n);
+    const double median = peaks[n/2];
+
+    for(int p = lo; p < hi; p++){
+      if(peak[p] >= 1e30) continue;
+      suggested->t0[p] = consts->t0[p] - (peak[p] - median);
+      nchanged++;
+    }
+  }
+
+  consts_update_min(suggested);
+  return nchanged;
+}
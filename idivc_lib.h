@@ -0,0 +1,255 @@
+/**
+  \author Matthew Strait
+  \brief C interface to the IDIVC time correction. Does not need ROOT.
+
+  All arrays are owned by the caller. Nothing here copies the input or
+  allocates memory except idivc_consts_new().
+*/
+
+#ifndef IDIVC_LIB_H
+#define IDIVC_LIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bump when the layout of anything in this file changes. */
+#define IDIVC_ABI_VERSION 1
+
+/* Number of PMTs that have timing constants. Those numbered below
+   IDIVC_NIDPMT are in the Inner Detector, the rest in the Inner Veto. */
+#define IDIVC_NPMT 468
+#define IDIVC_NIDPMT 390
+
+/* Number of hit slots per event in base.root */
+#define IDIVC_NSLOT 520
+
+/* Return codes of idivc_consts_add_fit() */
+#define IDIVC_FIT_USED      0 /* The point was used */
+#define IDIVC_FIT_UNFIT     1 /* Tube wasn't fit, probably it was off */
+#define IDIVC_FIT_BADERROR  2 /* Error too big. Very few hits? */
+#define IDIVC_FIT_BADPMT   -1 /* PMT number out of range */
+
+/* Timing constants for every PMT. Opaque so that it can grow. */
+typedef struct idivc_consts idivc_consts;
+
+/* Bits of idivc_result.valid */
+#define IDIVC_VALID_ID 1
+#define IDIVC_VALID_IV 2
+
+/* The answer for one event. Times are -1 and PMTs are -1 if no usable
+   hit was found in that detector. If the first hit was after 999 ns,
+   the time is -1 but the PMT is kept. -1 can also be a real time, so
+   test with idivc_id_valid() and idivc_iv_valid(), not the times. */
+typedef struct idivc_result {
+  float timeid;
+  float timeiv;
+  int firstidpmt;
+  int firstivpmt;
+  int valid; /* IDIVC_VALID_ID and IDIVC_VALID_IV for valid times */
+} idivc_result;
+
+/* Whether a valid time was found in the ID or IV */
+static inline int idivc_id_valid(const idivc_result * r)
+{
+  return r->valid & IDIVC_VALID_ID;
+}
+
+static inline int idivc_iv_valid(const idivc_result * r)
+{
+  return r->valid & IDIVC_VALID_IV;
+}
+
+/* Returns IDIVC_ABI_VERSION as compiled into the library. */
+int idivc_abi_version(void);
+
+/* Makes a table with all constants zero, which is what Monte Carlo
+   wants. Returns NULL if out of memory. Free with idivc_consts_free(). */
+idivc_consts * idivc_consts_new(void);
+void idivc_consts_free(idivc_consts * consts);
+
+/* Takes one point of a fitted timing table (a TGraphErrors like
+   finalt0table_caliter01, with the PMT number as x) and sets that PMT's
+   constant if the fit is usable. Returns one of IDIVC_FIT_*. */
+int idivc_consts_add_fit(idivc_consts * consts, double pmt, double time,
+                         double timee);
+
+/* Direct access to one PMT's constant. Setting returns 0 on success
+   and -1 if the PMT number is out of range. */
+int idivc_consts_set(idivc_consts * consts, int pmt, double time);
+double idivc_consts_get(const idivc_consts * consts, int pmt);
+
+/* Timing constants can be kept in a text file, which is much quicker
+   to load than a ROOT file. The first line is IDIVC_CONSTS_MAGIC. Each
+   other line is a PMT number and its constant, separated by spaces.
+   PMTs not listed have a constant of zero. Blank lines and lines
+   starting with # are ignored. */
+#define IDIVC_CONSTS_MAGIC "# idivc timing constants v1"
+
+/* Return codes of idivc_consts_read() other than 0 for success and a
+   positive line number for a line that couldn't be understood. */
+#define IDIVC_READ_NOFILE  -1 /* Couldn't open the file */
+#define IDIVC_READ_NOTTEXT -2 /* The file isn't in the text format */
+
+/* Sets constants from a file in the text format. Returns 0 on success
+   or one of the codes above. On failure, consts is left unchanged. */
+int idivc_consts_read(idivc_consts * consts, const char * filename);
+
+/* Writes constants to a file in the text format, with every nonzero
+   one exactly. Returns 0 on success or -1 on failure. */
+int idivc_consts_write(const idivc_consts * consts, const char * filename);
+
+/* Finds the first ID and IV hits for each of nevent events. Event i's
+   hits are tstart[i*nslot] ... tstart[i*nslot + nslot-1], and similarly
+   for pmt. Slots with a PMT outside [0, IDIVC_NPMT) or a non-positive
+   time are ignored. Results go in out[0] ... out[nevent-1]. */
+void idivc_process(const idivc_consts * consts, size_t nevent,
+                   size_t nslot, const double * tstart, const short * pmt,
+                   idivc_result * out);
+
+/* Histograms and counts of results, for data quality checks. Plain
+   arrays so that each thread can keep its own and merge them at the
+   end. Times are in 1 ns bins. In each histogram, bin 0 counts
+   underflows and the last bin overflows. Only valid times are filled,
+   and the difference only when both are valid. */
+#define IDIVC_SUM_NTIMEBIN 1000
+#define IDIVC_SUM_TIMELO 0
+#define IDIVC_SUM_TIMEHI 1000
+#define IDIVC_SUM_NDIFFBIN 1000
+#define IDIVC_SUM_DIFFLO -500
+#define IDIVC_SUM_DIFFHI 500
+
+typedef struct idivc_summary {
+  uint64_t nevent, nidvalid, nivvalid, nbothvalid;
+  uint64_t timeid[IDIVC_SUM_NTIMEBIN + 2];
+  uint64_t timeiv[IDIVC_SUM_NTIMEBIN + 2];
+  uint64_t timediff[IDIVC_SUM_NDIFFBIN + 2]; /* timeid - timeiv */
+  uint64_t firstidpmt[IDIVC_NPMT];
+  uint64_t firstivpmt[IDIVC_NPMT];
+} idivc_summary;
+
+void idivc_summary_clear(idivc_summary * sum);
+
+/* Adds nevent results to sum */
+void idivc_summary_add(idivc_summary * sum, const idivc_result * out,
+                       size_t nevent);
+
+/* Adds everything in from to into */
+void idivc_summary_merge(idivc_summary * into, const idivc_summary * from);
+
+/* Histograms, for each PMT, of its corrected hit times minus the time
+   of the first hit in the same detector, for working out better timing
+   constants in the same pass. Like idivc_summary, plain arrays so that
+   each thread can keep its own and merge them at the end. Bin 0 counts
+   underflows and the last bin overflows. */
+#define IDIVC_RES_NBIN 200
+#define IDIVC_RES_LO -25
+#define IDIVC_RES_HI 75
+
+/* PMTs with fewer residuals than this in range get no new constant */
+#define IDIVC_RES_MINCOUNT 100
+
+typedef struct idivc_residuals {
+  uint64_t counts[IDIVC_NPMT][IDIVC_RES_NBIN + 2];
+} idivc_residuals;
+
+void idivc_residuals_clear(idivc_residuals * res);
+
+/* Adds the hits of nevent events, given as to idivc_process(), with
+   the results it gave for them. Detectors with no valid time are
+   skipped, and so is each detector's first hit, whose residual is
+   always zero. */
+void idivc_residuals_add(idivc_residuals * res, const idivc_consts * consts,
+                         size_t nevent, size_t nslot, const double * tstart,
+                         const short * pmt, const idivc_result * out);
+
+/* Adds everything in from to into */
+void idivc_residuals_merge(idivc_residuals * into,
+                           const idivc_residuals * from);
+
+/* Suggests new constants that would line up the peak of each PMT's
+   residuals with the median peak of its detector. PMTs with too few
+   residuals keep their constants from consts. Returns the number of
+   PMTs given new constants. */
+int idivc_residuals_suggest(const idivc_residuals * res,
+                            const idivc_consts * consts,
+                            idivc_consts * suggested);
+
+/* The few earliest hits of an event in each detector, enough to redo
+   the time correction with new constants without the rest of the
+   event, as long as the constants haven't moved much. */
+#define IDIVC_NCAND 8
+
+/* Bytes in a mask with one bit per PMT */
+#define IDIVC_PMTMASK ((IDIVC_NPMT + 7)/8)
+
+typedef struct idivc_candidates {
+  int n;
+  /* Raw times and PMTs of up to IDIVC_NCAND hits in each detector,
+     in the same order as in the event */
+  double tstart[2*IDIVC_NCAND];
+  short pmt[2*IDIVC_NCAND];
+  /* Every hit left out had a corrected time at least this, or these
+     are 1e30 if nothing was left out */
+  double limitid, limitiv;
+  /* Bit p%8 of byte p/8 is set if a hit in PMT p was left out */
+  unsigned char leftout[IDIVC_PMTMASK];
+} idivc_candidates;
+
+/* Finds the candidates for one event with nslot slots */
+void idivc_candidates_find(const idivc_consts * consts, size_t nslot,
+                           const double * tstart, const short * pmt,
+                           idivc_candidates * cand);
+
+/* Finds how much each PMT's constant has decreased by going from oldc to
+   newc, negative if it increased. drop has room for IDIVC_NPMT. */
+void idivc_consts_drop(const idivc_consts * oldc, const idivc_consts * newc,
+                       double * drop);
+
+/* Redoes the time correction for an event from candidates found with
+   oldc, giving exactly what idivc_process() would with newc and the
+   whole event. drop is from idivc_consts_drop(). Returns 0 on success,
+   or -1 if a hit that was left out might now be first, in which case
+   the whole event is needed. Only the PMTs with hits left out matter. */
+int idivc_candidates_redo(const idivc_consts * newc, const double * drop,
+                          const idivc_candidates * cand, idivc_result * out);
+
+/* There are several versions of idivc_process(), compiled for different
+   instruction sets, which all give identical results. By default, the
+   best one that the CPU supports is used. Kernels are numbered from 0
+   to idivc_kernel_count()-1, worst first. The "early" kernel, which
+   stops looking once no later hit can be first, is only fast when hits
+   are in time order, so it is never used unless asked for or chosen by
+   idivc_autotune(). The kernel can be changed while other threads are
+   in idivc_process(); each call runs entirely on one kernel. */
+int idivc_kernel_count(void);
+const char * idivc_kernel_name(int kernel);
+
+/* Whether this CPU can run the given kernel */
+int idivc_kernel_supported(int kernel);
+
+/* Use the named kernel. Returns 0 on success, or -1 if it is unknown
+   or not supported by this CPU. */
+int idivc_use_kernel(const char * name);
+
+/* Use the best kernel that this CPU supports */
+void idivc_use_best_kernel(void);
+
+/* Name of the kernel in use */
+const char * idivc_current_kernel(void);
+
+/* Runs each supported kernel on the given events, which should be
+   representative, and uses whichever was fastest from then on. Takes
+   the same arguments as idivc_process(). Returns the kernel's name. */
+const char * idivc_autotune(const idivc_consts * consts, size_t nevent,
+                            size_t nslot, const double * tstart,
+                            const short * pmt, idivc_result * out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,17 +5,21 @@
 using namespace std;
 
 #include <signal.h>
+#include <stdio.h>
 #include <errno.h>
+#include <getopt.h>
 #include <vector>
+#include <string>
 #include "idivc_cont.h"
+#include "idivc_source.h"
 #include "idivc_root.h"
+#include "idivc_stream.h"
 #include "idivc_progress.cpp"
+#include "idivc_latency.cpp"
+#include "idivc_perf.cpp"
 #include "TFile.h"
 #include "TGraphErrors.h"
 
-static const int NPMT = 468;
-
-
 static void printhelp()
 {
   printf(
@@ -27,50 +31,350 @@ static void printhelp()
   "-o and -t are mandatory.\n"
   "For Monte Carlo, you may give \"MC\" for the timing file, in which\n"
   "case, no file is read and all zeros are used for the time constants.\n"
+  "If the constants change partway through, give -t more than once,\n"
+  "adding @ and the entry number from which each one applies, counting\n"
+  "from zero at the start of the first file, to all but the first:\n"
+  "  -t before.root -t after.root@123456\n"
+  "Timing files can be ROOT files with a finalt0table_caliter01 graph,\n"
+  "or text files made from them with idivc convert, which load faster.\n"
   "\n"
   "-c: Overwrite existing output file\n"
+  "-f: Write one output file per base.root file, each with the same\n"
+  "    number of entries as its input, so that it can be used as a\n"
+  "    friend. They are named after the -o file with _0000, _0001, etc.\n"
+  "    added, and the -o file holds a TChain of them all.\n"
   "-n [number] Process at most this many events\n"
-  "-h: This help text\n");
+  "-m [number] Don't read times for events with fewer than this many\n"
+  "    hits in known PMTs. They get the output for an event with no hits.\n"
+  "-k [kernel] Use this version of the time correction: scalar, early,\n"
+  "    sse4.2, avx2 or avx512. Or \"bench\" to time them all on the first\n"
+  "    events and use the fastest. By default, the best the CPU supports.\n"
+  "    early stops once no later hit can be first, which is fastest for\n"
+  "    events with many hits that are in time order.\n"
+  "-L: Time the reading, computing and writing of each event and print\n"
+  "    percentiles of each, and which events were slowest, at the end\n"
+  "-H: Read the CPU's hardware performance counters around reading,\n"
+  "    computing and writing each event and print per-event cycles,\n"
+  "    instructions per cycle, cache misses and branch misses at the end.\n"
+  "    This costs a few microseconds per event.\n"
+  "-s [number] Start at this event, counting from zero at the start of\n"
+  "    the first file. The output then also has each event's entry\n"
+  "    number, as it does with -S, --skim, --sample and recal.\n"
+  "--entry-offset [number] Add this to the entry numbers written, and\n"
+  "    always write them. The @ entries of -t count from the same place.\n"
+  "    plan gives each job this, where its first file starts among all\n"
+  "    of the plan's files.\n"
+  "-P [MB] While processing each file, read up to this much of the\n"
+  "    next one in the background so that it is in the page cache\n"
+  "    when we get to it. Helps with slow disks and network file systems.\n"
+  "-S [source] Read events as they are produced instead of from\n"
+  "    base.root files: \"-\" for stdin, \"unix:path\" to connect to a\n"
+  "    Unix socket, or the name of a FIFO or file. Can't be used with\n"
+  "    -f, -m, -n, -s or -P.\n"
+  "-B [number] With -S, save the output every this many events so that\n"
+  "    it can be read while idivc is running, and at least once a second\n"
+  "    while any events written are unsaved. Default 100, 0 for never.\n"
+  "--skim [id|iv|both] Only write events with a valid ID time, IV\n"
+  "    time, or both, along with their entry numbers in base.root, so\n"
+  "    that they can still be matched up. Can't be used with -f.\n"
+  "--sample [k] For a quick look, only do every k'th cluster of entries\n"
+  "    across all the base.root files, reading only what those need.\n"
+  "    The entry numbers are stored, and k is kept in the tree's\n"
+  "    UserInfo. -n limits the number of events sampled. Can't be used\n"
+  "    with -f, -s or -P.\n"
+  "--residuals [file] Also histogram, for each PMT, the corrected hit\n"
+  "    times minus the first hit time in its detector, and write that to\n"
+  "    the output file as idivc_residuals. Then write new timing\n"
+  "    constants that line up the peaks of those to this text file, to\n"
+  "    try with -t. -c overwrites it. Can't be used with -f or with more\n"
+  "    than one timing file.\n"
+  "--quantize [bits] Store times in this many bits, from 2 to 31,\n"
+  "    instead of as floats, and PMT numbers as shorts. With 16, times\n"
+  "    are stored to 1/32 ns. The number of bits and the precision are\n"
+  "    kept in the tree's UserInfo. A stored time of -1 is not exact, so\n"
+  "    a branch \"valid\" is added, with bit 1 set for a valid ID time\n"
+  "    and bit 2 for a valid IV time.\n"
+  "-C [file] Also save the earliest few hits of each event in each\n"
+  "    detector, and the timing constants, to this file, for use with\n"
+  "    idivc recal.\n"
+  "-h: This help text\n"
+  "\n"
+  "To find out how fast idivc could go if it were limited only by\n"
+  "reading or only by computing, use one of these instead of -o:\n"
+  "--io-only: Read the events and throw them away. -t isn't needed.\n"
+  "--compute-only [number] Read this many events into memory and do the\n"
+  "    time correction on them over and over for a few seconds\n"
+  "--no-write: Read the events and do the time correction, but don't\n"
+  "    write anything\n"
+  "Each prints how many events and megabytes per second it managed.\n"
+  "They can't be used with -f, -C, -L, -H or -S.\n"
+  "\n"
+  "To split a big job across many computers:\n"
+  "idivc plan -j [number of jobs] -o [plan file] [base.root files]\n"
+  "  Writes one line per job to the plan file giving the -s, -n and\n"
+  "  --entry-offset options and base.root files for it, with about the\n"
+  "  same amount of data for each job. -c overwrites an existing plan\n"
+  "  file.\n"
+  "idivc merge -o [output file] [job output files]\n"
+  "  Concatenates the jobs' output, in the order given, without\n"
+  "  recompressing it. -c overwrites an existing output file.\n"
+  "  Each job's output has an entry branch, counting from the start of\n"
+  "  the first base.root file given to plan, so the merged output can be\n"
+  "  matched up with all of them.\n"
+  "\n"
+  "To feed events to idivc -S from base.root files:\n"
+  "idivc produce -o [destination] [base.root files]\n"
+  "  Writes events to the destination, which is given like for -S,\n"
+  "  except that with \"unix:path\", it waits for idivc to connect.\n"
+  "  Default stdout. -s and -n work as above.\n"
+  "\n"
+  "To redo the time correction with new timing constants:\n"
+  "idivc recal -t [new timing file] -o [output file] [file from -C]\n"
+  "            [base.root files]\n"
+  "  Uses the hits saved with -C, which is enough for nearly all events\n"
+  "  unless the constants of PMTs with hits that weren't saved moved\n"
+  "  earlier by more than the spread of those hits.\n"
+  "  The few other events are read again from the base.root files,\n"
+  "  which must be the same ones as the first time. If none are given,\n"
+  "  says how many events need them and stops. Always give the file\n"
+  "  from the original run, not from a previous recal. -c overwrites\n"
+  "  an existing output file.\n"
+  "\n"
+  "To make a text timing file, which loads much faster:\n"
+  "idivc convert -o [text file] [timing file]\n"
+  "  Keeps the same constants that idivc would use from the timing\n"
+  "  file. -c overwrites an existing text file.\n");
+}
+
+/* Returns the number given as an argument to the option named optname,
+such as "--sample", or exits if it isn't a non-negative integer. */
+static uint64_t getnumber(const char * const arg, const char * const optname)
+{
+  errno = 0;
+  char * endptr;
+  const unsigned long long n = strtoull(arg, &endptr, 10);
+  if((errno == ERANGE && n == ULLONG_MAX) ||
+     (errno != 0 && n == 0) ||
+     endptr == arg || *endptr != '\0' || arg[0] == '-'){
+    fprintf(stderr, "%s (given with %s) isn't a number I can handle\n",
+            arg, optname);
+    exit(1);
+  }
+  return n;
+}
+
+/* The same for the single-letter option -opt */
+static uint64_t getnumber(const char * const arg, const char opt)
+{
+  const char optname[3] = { '-', opt, '\0' };
+  return getnumber(arg, optname);
+}
+
+// Minimum number of hits in known PMTs, as given with -m
+static int minhits = 0;
+
+// Whether to save the earliest hits of each event, as asked for with -C
+static bool savecands = false;
+
+// Whether we are just finding out how fast one part of idivc can go,
+// and if so, which part, and how many events to use for --compute-only
+enum runmode { RUN_NORMAL, RUN_IOONLY, RUN_COMPUTEONLY, RUN_NOWRITE };
+static runmode mode = RUN_NORMAL;
+static unsigned int ncompute = 0;
+
+// Timing constants, each applying from its first entry up to the next
+// one's, as given with -t
+struct consts_period {
+  uint64_t first;
+  const idivc_consts * consts;
+};
+static vector<consts_period> periods;
+static vector<const char *> timingargs;
+
+// Values returned by getopt_long() for options with no short form
+enum { OPT_IOONLY = 256, OPT_COMPUTEONLY, OPT_NOWRITE, OPT_SKIM,
+       OPT_QUANTIZE, OPT_SAMPLE, OPT_RESIDUALS, OPT_ENTRYOFFSET };
+
+// Which events to write, as given with --skim
+static skim_type skim = SKIM_NONE;
+
+// Bits to store times in, as given with --quantize, or 0 for floats
+static int timebits = 0;
+
+// Do every this many clusters, as given with --sample, or 0 for all
+static unsigned int samplek = 0;
+
+// Where this job's first input file starts in the chain of all of a
+// plan's files, as given with --entry-offset, and whether it was
+static uint64_t entryoffset = 0;
+static bool haveentryoffset = false;
+
+// Where to write constants worked out from the residuals of hit times,
+// as given with --residuals, and the histograms of them
+static const char * residualfile = NULL;
+static idivc_residuals * residuals = NULL;
+
+static bool enough_hits(__attribute__((unused)) const uint64_t entry,
+                        const short * const pmt)
+{
+  int n = 0;
+  for(int i = 0; i < IDIVC_NSLOT; i++)
+    if(pmt[i] >= 0 && pmt[i] < IDIVC_NPMT && ++n >= minhits) return true;
+  return false;
 }
 
 /** Parses the command line and returns the position of the first file
 name (i.e. the first argument not parsed). */
 static int handle_cmdline(int argc, char ** argv, bool & clobber,
+                          bool & perfile, uint64_t & first,
                           unsigned int & nevents, char * & outfile,
-                          char * & timingfile)
+                          char * & timingfile, char * & kernel,
+                          uint64_t & prefetchmb, bool & latency,
+                          bool & counters, char * & stream,
+                          unsigned int & flushevery, char * & candfile)
 {
-  const char * const opts = "o:chn:t:";
+  const char * const opts = "o:B:C:cfHhk:Lm:n:P:S:s:t:";
+  const struct option longopts[] = {
+    { "io-only",      no_argument,       NULL, OPT_IOONLY },
+    { "compute-only", required_argument, NULL, OPT_COMPUTEONLY },
+    { "no-write",     no_argument,       NULL, OPT_NOWRITE },
+    { "skim",         required_argument, NULL, OPT_SKIM },
+    { "quantize",     required_argument, NULL, OPT_QUANTIZE },
+    { "sample",       required_argument, NULL, OPT_SAMPLE },
+    { "residuals",    required_argument, NULL, OPT_RESIDUALS },
+    { "entry-offset", required_argument, NULL, OPT_ENTRYOFFSET },
+    { NULL, 0, NULL, 0 }
+  };
   bool done = false;
  
   while(!done){
-    char whatwegot;
-    switch(whatwegot = getopt(argc, argv, opts)){
+    int whatwegot;
+    switch(whatwegot = getopt_long(argc, argv, opts, longopts, NULL)){
       case -1:
         done = true;
         break;
-      case 'n':
-        errno = 0;
+      case OPT_IOONLY:
+        mode = RUN_IOONLY;
+        break;
+      case OPT_COMPUTEONLY:{
         char * endptr;
-        nevents = strtol(optarg, &endptr, 10);
-        if((errno == ERANGE && (nevents == UINT_MAX)) || 
-           (errno != 0 && nevents == 0) || 
-           endptr == optarg || *endptr != '\0'){
+        const unsigned long long n = strtoull(optarg, &endptr, 10);
+        if(endptr == optarg || *endptr != '\0' || optarg[0] == '-' ||
+           n == 0 || n >= UINT_MAX){
+          fprintf(stderr, "%s (given with --compute-only) should be a "
+                  "positive number\n", optarg);
+          exit(1);
+        }
+        ncompute = n;
+        mode = RUN_COMPUTEONLY;
+        break;
+      }
+      case OPT_NOWRITE:
+        mode = RUN_NOWRITE;
+        break;
+      case OPT_RESIDUALS:
+        residualfile = optarg;
+        break;
+      case OPT_ENTRYOFFSET:
+        entryoffset = getnumber(optarg, "--entry-offset");
+        haveentryoffset = true;
+        break;
+      case OPT_SAMPLE:{
+        const uint64_t k = getnumber(optarg, "--sample");
+        if(k < 1 || k > INT_MAX){
+          fprintf(stderr, "%s (given with --sample) should be a positive "
+                  "number\n", optarg);
+          exit(1);
+        }
+        samplek = k;
+        break;
+      }
+      case OPT_QUANTIZE:{
+        const uint64_t n = getnumber(optarg, "--quantize");
+        if(n < 2 || n > 31){
+          fprintf(stderr, "%s (given with --quantize) should be from 2 to "
+                  "31\n", optarg);
+          exit(1);
+        }
+        timebits = n;
+        break;
+      }
+      case OPT_SKIM:
+        if     (!strcmp(optarg, "id"))   skim = SKIM_ID;
+        else if(!strcmp(optarg, "iv"))   skim = SKIM_IV;
+        else if(!strcmp(optarg, "both")) skim = SKIM_BOTH;
+        else{
+          fprintf(stderr, "--skim takes id, iv or both, not %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'n':{
+        const uint64_t n = getnumber(optarg, 'n');
+        if(n >= UINT_MAX){
           fprintf(stderr,
             "%s (given with -n) isn't a number I can handle\n", optarg);
           exit(1);
         }
+        nevents = n;
+        break;
+      }
+      case 's':
+        first = getnumber(optarg, 's');
+        break;
+      case 'P':
+        prefetchmb = getnumber(optarg, 'P');
+        break;
+      case 'S':
+        stream = optarg;
+        break;
+      case 'B':{
+        const uint64_t n = getnumber(optarg, 'B');
+        if(n >= UINT_MAX){
+          fprintf(stderr,
+            "%s (given with -B) isn't a number I can handle\n", optarg);
+          exit(1);
+        }
+        flushevery = n;
         break;
+      }
+      case 'L':
+        latency = true;
+        break;
+      case 'H':
+        counters = true;
+        break;
+      case 'k':
+        kernel = optarg;
+        break;
+      case 'm':{
+        const uint64_t n = getnumber(optarg, 'm');
+        if(n == 0 || n > IDIVC_NSLOT){
+          fprintf(stderr, "%s (given with -m) should be from 1 to %d\n",
+                  optarg, IDIVC_NSLOT);
+          exit(1);
+        }
+        minhits = n;
+        break;
+      }
       case 'o':
         outfile = optarg;
         break;
+      case 'C':
+        candfile = optarg;
+        savecands = true;
+        break;
       case 'c':
         clobber = true;
         break;
+      case 'f':
+        perfile = true;
+        break;
       case 'h':
         printhelp();
         exit(0);
       case 't':
         timingfile = optarg;
+        timingargs.push_back(optarg);
         break;
       default:
         printhelp();
@@ -78,26 +382,181 @@ static int handle_cmdline(int argc, char ** argv, bool & clobber,
     }
   }  
 
-  if(!timingfile){
+  if(!timingfile && mode != RUN_IOONLY){
     fprintf(stderr, "You must give an timing file or \"MC\" with -t\n");
     printhelp();
     exit(1);
   }
 
-  if(!outfile){
+  if(samplek && (perfile || first || prefetchmb || stream ||
+                 mode != RUN_NORMAL)){
+    fprintf(stderr, "Can't use --sample with -f, -s, -P, -S, --io-only, "
+            "--compute-only or --no-write\n");
+    exit(1);
+  }
+
+  if(perfile && skim != SKIM_NONE){
+    fprintf(stderr, "Can't use --skim with -f, since the output files "
+            "wouldn't line up with their inputs\n");
+    exit(1);
+  }
+
+  if(residualfile && (perfile || timingargs.size() > 1 ||
+                      mode != RUN_NORMAL)){
+    fprintf(stderr, "Can't use --residuals with -f, more than one timing "
+            "file, --io-only, --compute-only or --no-write\n");
+    exit(1);
+  }
+
+  if(residualfile && !clobber && !access(residualfile, F_OK)){
+    fprintf(stderr, "%s already exists. Use -c to overwrite it.\n",
+            residualfile);
+    exit(1);
+  }
+
+  if(savecands && timingargs.size() > 1){
+    fprintf(stderr, "Can't use -C with more than one timing file\n");
+    exit(1);
+  }
+
+  if(mode != RUN_NORMAL){
+    if(perfile || savecands || latency || counters || stream){
+      fprintf(stderr, "Can't use -f, -C, -L, -H or -S with --io-only, "
+              "--compute-only or --no-write\n");
+      exit(1);
+    }
+  }
+  else if(!outfile){
     fprintf(stderr, "You must give an output file name with -o\n");
     printhelp();
     exit(1);
   }
 
+  if(stream){
+    if(perfile || first || nevents || minhits || prefetchmb){
+      fprintf(stderr, "Can't use -f, -m, -n, -s or -P with -S\n");
+      exit(1);
+    }
+    if(argc > optind){
+      fprintf(stderr, "Don't give base.root files with -S\n");
+      exit(1);
+    }
+    return optind;
+  }
+
   if(argc <= optind){
     fprintf(stderr, "Please give at least one base.root file.\n\n");
     printhelp();
     exit(1);
   }
+
+  if(perfile && first){
+    fprintf(stderr, "Can't use -f with -s, since the first output file "
+            "wouldn't line up with its input\n");
+    exit(1);
+  }
   return optind;
 }
 
+/* Handles "idivc plan ...". argv[0] is "plan". */
+static int plan_main(int argc, char ** argv)
+{
+  bool clobber = false;
+  int njobs = 0;
+  const char * planfile = NULL;
+
+  int opt;
+  while((opt = getopt(argc, argv, "chj:o:")) != -1){
+    switch(opt){
+      case 'c': clobber = true; break;
+      case 'j':{
+        const uint64_t n = getnumber(optarg, 'j');
+        if(n > INT_MAX){
+          fprintf(stderr, "%s (given with -j) is too many jobs\n", optarg);
+          exit(1);
+        }
+        njobs = n;
+        break;
+      }
+      case 'o': planfile = optarg; break;
+      case 'h': printhelp(); exit(0);
+      default: printhelp(); exit(1);
+    }
+  }
+
+  if(njobs <= 0 || !planfile || argc <= optind){
+    fprintf(stderr, "idivc plan needs -j, -o and at least one base.root "
+            "file\n");
+    exit(1);
+  }
+
+  root_plan_shards(njobs, clobber, planfile, argv + optind, argc - optind);
+  return 0;
+}
+
+/* Handles "idivc merge ...". argv[0] is "merge". */
+static int merge_main(int argc, char ** argv)
+{
+  bool clobber = false;
+  const char * outfile = NULL;
+
+  int opt;
+  while((opt = getopt(argc, argv, "cho:")) != -1){
+    switch(opt){
+      case 'c': clobber = true; break;
+      case 'o': outfile = optarg; break;
+      case 'h': printhelp(); exit(0);
+      default: printhelp(); exit(1);
+    }
+  }
+
+  if(!outfile || argc <= optind){
+    fprintf(stderr, "idivc merge needs -o and at least one file to "
+            "merge\n");
+    exit(1);
+  }
+
+  root_merge(clobber, outfile, argv + optind, argc - optind);
+  return 0;
+}
+
+/* Handles "idivc produce ...". argv[0] is "produce". */
+static int produce_main(int argc, char ** argv)
+{
+  uint64_t first = 0, nevents = 0;
+  const char * dest = "-";
+
+  int opt;
+  while((opt = getopt(argc, argv, "hn:o:s:")) != -1){
+    switch(opt){
+      case 'n': nevents = getnumber(optarg, 'n'); break;
+      case 's': first = getnumber(optarg, 's'); break;
+      case 'o': dest = optarg; break;
+      case 'h': printhelp(); exit(0);
+      default: printhelp(); exit(1);
+    }
+  }
+
+  if(argc <= optind){
+    fprintf(stderr, "idivc produce needs at least one base.root file\n");
+    exit(1);
+  }
+
+  FILE * const out = open_stream_sink(dest);
+  const uint64_t n =
+    root_init_inputonly(first, nevents, argv + optind, argc - optind);
+
+  idivc_source * const source = make_root_source(first, n);
+  idivc_input_event ev;
+  uint64_t entry;
+  while(source->next(ev, entry)) write_frame(out, ev, entry);
+  delete source;
+
+  fclose(out);
+  root_finish();
+  return 0;
+}
+
 static void on_segv_or_bus(const int signal)
 {
   fprintf(stderr, "Got %s. Exiting.\n", signal==SIGSEGV? "SEGV": "BUS");
@@ -116,63 +575,156 @@ static void endearly(__attribute__((unused)) int signal)
   _exit(1); // See comment above
 }
 
-static idivc_output_event doit(const idivc_input_event & ev,
-                               const double * const fido_consts)
-{
-  idivc_output_event out;
-  memset(&out, 0, sizeof(out));
+// The constants in use and the entries [from, until) that they are for,
+// so that we only look for others when crossing into another period
+struct consts_cursor {
+  const idivc_consts * consts;
+  uint64_t from, until;
+};
 
-  out.timeid = out.timeiv = 9999;
-  out.firstidpmt = out.firstivpmt = -1;
+static const consts_cursor NOCONSTS = { NULL, 1, 0 };
 
-  for(int i = 0; i < 520; i++){
-    if(ev.pmt[i] < 0 || ev.pmt[i] >= NPMT) continue;
+/* Returns the constants for this entry. Quick unless it is in a
+different period than the one before. Periods are given in entries of
+the whole plan, so are moved by --entry-offset to match this job's. */
+static inline const idivc_consts * consts_at(consts_cursor & c,
+                                             const uint64_t entry)
+{
+  if(__builtin_expect(entry >= c.from && entry < c.until, 1))
+    return c.consts;
 
-    const double time = ev.tstart[i] + fido_consts[ev.pmt[i]];
-   
-    if(ev.tstart[i] <= 0) continue;
+  const uint64_t planentry = entryoffset + entry;
+  unsigned int i = 0;
+  while(i+1 < periods.size() && periods[i+1].first <= planentry) i++;
+  c.consts = periods[i].consts;
+  c.from = periods[i].first > entryoffset? periods[i].first - entryoffset: 0;
+  c.until = i+1 < periods.size()? periods[i+1].first - entryoffset
+                                : UINT64_MAX;
+  return c.consts;
+}
 
-    if(ev.pmt[i] < 390){
-      if(time < out.timeid){
-        out.timeid = time; 
-        out.firstidpmt = ev.pmt[i];
-      }
-    } 
-    else{
-      if(time < out.timeiv){
-        out.timeiv = time;
-        out.firstivpmt = ev.pmt[i];
-      }
-    }
-  }    
+static idivc_output_event doit(const idivc_input_event & ev,
+                               const idivc_consts * const fido_consts)
+{
+  idivc_output_event out;
+  idivc_process(fido_consts, 1, IDIVC_NSLOT, ev.tstart, ev.pmt, &out);
+  return out;
+}
 
-  if(out.timeiv > 999) out.timeiv = -1;
-  if(out.timeid > 999) out.timeid = -1;
+static void save_candidates(const idivc_input_event & ev,
+                            const uint64_t entry,
+                            const idivc_consts * const fido_consts)
+{
+  idivc_candidates cand;
+  idivc_candidates_find(fido_consts, IDIVC_NSLOT, ev.tstart, ev.pmt, &cand);
+  write_candidates(cand, entry);
+}
 
-  return out;
+static void doit_loop(idivc_source & source)
+{
+  printf("Working...\n");
+  // Streams don't know how long they are
+  const bool showprogress = source.size() > 0;
+  if(showprogress) initprogressindicator(source.size(), 4);
+
+  // NOTE: Going through the events in order is much faster than
+  // jumping around.
+  idivc_input_event in;
+  uint64_t entry;
+  consts_cursor cursor = NOCONSTS;
+  for(unsigned int i = 0; source.next(in, entry); i++){
+    const idivc_consts * const fido_consts = consts_at(cursor, entry);
+    const idivc_output_event out = doit(in, fido_consts);
+    write_event(out, entry);
+    if(residuals)
+      idivc_residuals_add(residuals, fido_consts, 1, IDIVC_NSLOT, in.tstart,
+                          in.pmt, &out);
+    if(savecands) save_candidates(in, entry, fido_consts);
+    if(showprogress) progressindicator(i, "IDIVC");
+  }
+  printf("All done working.\n");
 }
 
-static void doit_loop(const unsigned int nevent,
-                      const double * const fido_consts)
+/* The same as doit_loop(), but timing each stage of each event if
+latency is true, and reading the hardware counters around each stage if
+counters is true. */
+static void doit_loop_instrumented(idivc_source & source,
+                                   const bool latency, bool counters)
 {
   printf("Working...\n");
-  initprogressindicator(nevent, 4);
+  const bool showprogress = source.size() > 0;
+  if(showprogress) initprogressindicator(source.size(), 4);
+  if(latency) initlatency();
+  if(counters) counters = initperf();
 
-  // NOTE: Do not attempt to start anywhere but on event zero.
-  // For better performance, we don't allow random seeks.
-  for(unsigned int i = 0; i < nevent; i++)
-    write_event(doit(get_event(i), fido_consts)), // never do this
-    progressindicator(i, "IDIVC");
+  uint64_t c0[PERF_NVALUE], c1[PERF_NVALUE],
+           c2[PERF_NVALUE], c3[PERF_NVALUE];
+  if(counters) perf_read(c3);
+
+  idivc_input_event in;
+  uint64_t entry;
+  unsigned int nevent = 0;
+  consts_cursor cursor = NOCONSTS;
+  while(true){
+    if(counters) memcpy(c0, c3, sizeof(c0));
+    const uint64_t t0 = latency? latency_now(): 0;
+    if(!source.next(in, entry)) break;
+    const uint64_t t1 = latency? latency_now(): 0;
+    if(counters) perf_read(c1);
+    const idivc_consts * const fido_consts = consts_at(cursor, entry);
+    const idivc_output_event out = doit(in, fido_consts);
+    if(counters) perf_read(c2);
+    const uint64_t t2 = latency? latency_now(): 0;
+    write_event(out, entry);
+    if(savecands) save_candidates(in, entry, fido_consts);
+    if(residuals)
+      idivc_residuals_add(residuals, fido_consts, 1, IDIVC_NSLOT, in.tstart,
+                          in.pmt, &out);
+    const uint64_t t3 = latency? latency_now(): 0;
+    if(counters) perf_read(c3);
+
+    if(latency){
+      latency_record(LAT_READ,    t1 - t0, entry);
+      latency_record(LAT_COMPUTE, t2 - t1, entry);
+      latency_record(LAT_WRITE,   t3 - t2, entry);
+    }
+    if(counters){
+      perf_add(LAT_READ,    c0, c1);
+      perf_add(LAT_COMPUTE, c1, c2);
+      perf_add(LAT_WRITE,   c2, c3);
+    }
+
+    if(showprogress) progressindicator(nevent, "IDIVC");
+    nevent++;
+  }
   printf("All done working.\n");
+  if(latency) printlatency();
+  if(counters) printperf(nevent);
 }
 
-static double * getfidoconsts(const char * const timingfilename)
+static idivc_consts * getfidoconsts(const char * const timingfilename)
 {
-  double * const consts = (double*)malloc(NPMT*sizeof(double));
-  memset(consts, 0, NPMT*sizeof(double));
+  idivc_consts * const consts = idivc_consts_new();
+  if(!consts){
+    fprintf(stderr, "Out of memory for timing constants\n");
+    exit(1);
+  }
 
   if(!strcmp(timingfilename, "MC")) return consts;
 
+  // Try the quick text format first
+  const int readerr = idivc_consts_read(consts, timingfilename);
+  if(readerr == 0) return consts;
+  if(readerr == IDIVC_READ_NOFILE){
+    printf("Could not open timing file %s\n", timingfilename);
+    exit(1);
+  }
+  if(readerr > 0){
+    printf("Line %d of timing file %s doesn't make sense\n", readerr,
+           timingfilename);
+    exit(1);
+  }
+
   TFile * hey = new TFile(timingfilename, "read");
 
   if(!hey || hey->IsZombie()){
@@ -193,15 +745,16 @@ static double * getfidoconsts(const char * const timingfilename)
     calgraph->GetPoint(i, pmt, time);
     const double timee = calgraph->GetErrorY(i);
 
-    // means tube wasn't fit, probably because it was powered off
-    if(time == 0 || timee == 0 || timee == 1) continue;
-    
-    // Very few hits in this run?  Shouldn't really happen.
-    if(timee > 1){ printf("error of %f...\n", timee); continue; }
-
-    if(pmt >= NPMT){ printf("bad PMT number %d\n", int(pmt)); exit(1); }
-
-    consts[int(pmt)] = time;
+    switch(idivc_consts_add_fit(consts, pmt, time, timee)){
+      case IDIVC_FIT_BADERROR:
+        printf("error of %f...\n", timee);
+        break;
+      case IDIVC_FIT_BADPMT:
+        printf("bad PMT number %d\n", int(pmt));
+        exit(1);
+      default:
+        break;
+    }
   }
 
   delete calgraph;
@@ -210,6 +763,334 @@ static double * getfidoconsts(const char * const timingfilename)
   return consts;
 }
 
+/* Handles "idivc convert ...". argv[0] is "convert". */
+static int convert_main(int argc, char ** argv)
+{
+  bool clobber = false;
+  const char * outfile = NULL;
+
+  int opt;
+  while((opt = getopt(argc, argv, "cho:")) != -1){
+    switch(opt){
+      case 'c': clobber = true; break;
+      case 'o': outfile = optarg; break;
+      case 'h': printhelp(); exit(0);
+      default: printhelp(); exit(1);
+    }
+  }
+
+  if(!outfile || argc != optind + 1){
+    fprintf(stderr, "idivc convert needs -o and one timing file\n");
+    exit(1);
+  }
+
+  if(!clobber && !access(outfile, F_OK)){
+    fprintf(stderr, "%s already exists. Use -c to overwrite it.\n",
+            outfile);
+    exit(1);
+  }
+
+  idivc_consts * const consts = getfidoconsts(argv[optind]);
+  if(idivc_consts_write(consts, outfile)){
+    fprintf(stderr, "Could not write %s\n", outfile);
+    exit(1);
+  }
+  idivc_consts_free(consts);
+  return 0;
+}
+
+/* Writes the residual histograms to the output file and the constants
+suggested by them to residualfile. */
+static void finish_residuals(const idivc_consts * const fido_consts)
+{
+  write_residuals(*residuals);
+
+  idivc_consts * const suggested = idivc_consts_new();
+  if(!suggested){
+    fprintf(stderr, "Out of memory for timing constants\n");
+    exit(1);
+  }
+  const int nchanged =
+    idivc_residuals_suggest(residuals, fido_consts, suggested);
+  if(idivc_consts_write(suggested, residualfile)){
+    fprintf(stderr, "Could not write %s\n", residualfile);
+    exit(1);
+  }
+  printf("Wrote new constants for %d PMTs to %s\n", nchanged, residualfile);
+  idivc_consts_free(suggested);
+}
+
+/* Reads the timing files given with -t. Each but the first ends with
+@ and the entry from which it applies. */
+static void loadconsts()
+{
+  for(unsigned int i = 0; i < timingargs.size(); i++){
+    string name = timingargs[i];
+    consts_period period = { 0, NULL };
+
+    // Only if it's followed by a number, so that file names can have @
+    size_t at = name.rfind('@');
+    if(at != string::npos && (at+1 == name.size() ||
+       name.find_first_not_of("0123456789", at+1) != string::npos))
+      at = string::npos;
+    if(at != string::npos){
+      period.first = getnumber(name.c_str() + at + 1, 't');
+      name.erase(at);
+    }
+
+    if(i == 0 && period.first != 0){
+      fprintf(stderr, "The first timing file must apply from the start, "
+              "but %s doesn't\n", timingargs[i]);
+      exit(1);
+    }
+    if(i > 0 && at == string::npos){
+      fprintf(stderr, "Please say which entry %s applies from by adding "
+              "@ and the entry number\n", timingargs[i]);
+      exit(1);
+    }
+    if(i > 0 && period.first <= periods.back().first){
+      fprintf(stderr, "Timing files must be given in order of the entries "
+              "they apply from\n");
+      exit(1);
+    }
+
+    period.consts = getfidoconsts(name.c_str());
+    periods.push_back(period);
+  }
+}
+
+/* Chooses the version of the time correction to use. If kernel is
+"bench", times them all on the first events, otherwise uses the one
+named, or the best one the CPU supports if kernel is NULL. */
+static void choosekernel(const char * const kernel, const uint64_t first,
+                         const unsigned int nevent,
+                         const idivc_consts * const fido_consts)
+{
+  if(!kernel || (!strcmp(kernel, "bench") && nevent == 0)){
+    idivc_use_best_kernel();
+  }
+  else if(!strcmp(kernel, "bench")){
+    const unsigned int nbench = nevent < 1000? nevent: 1000;
+    vector<double> tstart(nbench*IDIVC_NSLOT);
+    vector<short> pmt(nbench*IDIVC_NSLOT);
+    vector<idivc_output_event> out(nbench);
+    for(unsigned int i = 0; i < nbench; i++){
+      const idivc_input_event ev = get_event(first + i);
+      memcpy(&tstart[i*IDIVC_NSLOT], ev.tstart, sizeof(ev.tstart));
+      memcpy(&pmt[i*IDIVC_NSLOT], ev.pmt, sizeof(ev.pmt));
+    }
+    idivc_autotune(fido_consts, nbench, IDIVC_NSLOT, &tstart[0], &pmt[0],
+                   &out[0]);
+  }
+  else if(idivc_use_kernel(kernel)){
+    fprintf(stderr, "%s (given with -k) is unknown or not supported by this "
+            "CPU. Options are:", kernel);
+    for(int k = 0; k < idivc_kernel_count(); k++)
+      if(idivc_kernel_supported(k))
+        fprintf(stderr, " %s", idivc_kernel_name(k));
+    fprintf(stderr, "\n");
+    exit(1);
+  }
+
+  printf("Using the %s kernel\n", idivc_current_kernel());
+}
+
+/* Handles "idivc recal ...". argv[0] is "recal". */
+static int recal_main(int argc, char ** argv)
+{
+  bool clobber = false;
+  const char * outfile = NULL, * timingfile = NULL;
+
+  int opt;
+  while((opt = getopt(argc, argv, "cho:t:")) != -1){
+    switch(opt){
+      case 'c': clobber = true; break;
+      case 'o': outfile = optarg; break;
+      case 't': timingfile = optarg; break;
+      case 'h': printhelp(); exit(0);
+      default: printhelp(); exit(1);
+    }
+  }
+
+  if(!outfile || !timingfile || argc <= optind){
+    fprintf(stderr, "idivc recal needs -o, -t and a file written with "
+            "-C\n");
+    exit(1);
+  }
+
+  const char * const candname = argv[optind];
+  const int file1 = optind + 1;
+  const bool havebase = argc > file1;
+
+  // The candidate file holds the constants it was made with
+  const idivc_consts * const oldconsts = getfidoconsts(candname);
+  const idivc_consts * const newconsts = getfidoconsts(timingfile);
+
+  int nchanged = 0;
+  for(int p = 0; p < IDIVC_NPMT; p++)
+    nchanged += idivc_consts_get(oldconsts, p)
+             != idivc_consts_get(newconsts, p);
+  printf("%d PMTs have new constants\n", nchanged);
+
+  double drop[IDIVC_NPMT];
+  idivc_consts_drop(oldconsts, newconsts, drop);
+
+  const uint64_t nevent = root_open_candidates(candname);
+  idivc_candidates cand;
+  idivc_output_event out;
+  uint64_t entry;
+
+  // Rather than stop halfway, check first whether we'll need base.root
+  if(!havebase){
+    uint64_t nneed = 0, firstneed = 0;
+    for(uint64_t i = 0; i < nevent; i++){
+      get_candidates(i, cand, entry);
+      if(idivc_candidates_redo(newconsts, drop, &cand, &out) &&
+         !nneed++)
+        firstneed = entry;
+    }
+    if(nneed){
+      fprintf(stderr, "%lu events, starting with entry %lu, need to be read "
+              "again. Please give the base.root files.\n",
+              (unsigned long)nneed, (unsigned long)firstneed);
+      exit(1);
+    }
+  }
+  else{
+    root_init_inputonly(0, 0, argv + file1, argc - file1);
+  }
+
+  root_init_stream(clobber, outfile, 0);
+  choosekernel(NULL, 0, 0, newconsts);
+
+  printf("Working...\n");
+  initprogressindicator(nevent, 4);
+  uint64_t nreread = 0;
+  for(uint64_t i = 0; i < nevent; i++){
+    get_candidates(i, cand, entry);
+    if(idivc_candidates_redo(newconsts, drop, &cand, &out)){
+      out = doit(get_event(entry), newconsts);
+      nreread++;
+    }
+    write_event(out, entry);
+    progressindicator(i, "IDIVC");
+  }
+  printf("All done working. Read %lu of %lu events from base.root\n",
+         (unsigned long)nreread, (unsigned long)nevent);
+
+  root_finish();
+  return 0;
+}
+
+static void printrate(const char * const what, const uint64_t nevent,
+                      const double bytes, const double seconds)
+{
+  printf("%s: %lu events in %.2f s: %.0f events/s, %.1f MB/s\n", what,
+         (unsigned long)nevent, seconds, nevent/seconds,
+         bytes/seconds/(1 << 20));
+}
+
+/* Reads the events, and for --no-write does the time correction on
+them, and says how fast that went. MB/s counts what was read from disk,
+before decompressing. */
+static void read_only_loop(idivc_source & source)
+{
+  printf("Working...\n");
+  initprogressindicator(source.size(), 4);
+
+  const double bytes0 = TFile::GetFileBytesRead();
+  const uint64_t t0 = latency_now();
+
+  idivc_input_event in;
+  uint64_t entry;
+  unsigned int i = 0;
+  consts_cursor cursor = NOCONSTS;
+  for(; source.next(in, entry); i++){
+    // This can't be optimized away since it is in the library
+    if(mode == RUN_NOWRITE) doit(in, consts_at(cursor, entry));
+    progressindicator(i, "IDIVC");
+  }
+
+  const double seconds = (latency_now() - t0)*1e-9;
+  printf("All done working.\n");
+  printrate(mode == RUN_NOWRITE? "Read and computed": "Read", i,
+            TFile::GetFileBytesRead() - bytes0, seconds);
+}
+
+/* Reads the first ncompute events into memory and does the time
+correction on them again and again, and says how fast that went. MB/s
+counts the hits gone through, as stored in memory. */
+static void compute_only_loop(const uint64_t first, unsigned int nevent)
+{
+  if(nevent > ncompute) nevent = ncompute;
+
+  printf("Reading %u events into memory...\n", nevent);
+  vector<double> tstart((size_t)nevent*IDIVC_NSLOT);
+  vector<short> pmt((size_t)nevent*IDIVC_NSLOT);
+  vector<idivc_output_event> out(nevent);
+  for(unsigned int i = 0; i < nevent; i++){
+    const idivc_input_event ev = get_event(first + i);
+    memcpy(&tstart[(size_t)i*IDIVC_NSLOT], ev.tstart, sizeof(ev.tstart));
+    memcpy(&pmt[(size_t)i*IDIVC_NSLOT], ev.pmt, sizeof(ev.pmt));
+  }
+
+  // Long enough to get past any warm up and noise
+  const double minseconds = 3;
+
+  printf("Working...\n");
+  const uint64_t t0 = latency_now();
+  uint64_t npass = 0;
+  double seconds;
+  do{
+    // As many events at a time as use the same constants
+    consts_cursor cursor = NOCONSTS;
+    for(unsigned int i = 0; i < nevent; ){
+      const idivc_consts * const fido_consts = consts_at(cursor, first + i);
+      const unsigned int n = cursor.until - first - i < nevent - i?
+                             cursor.until - first - i: nevent - i;
+      idivc_process(fido_consts, n, IDIVC_NSLOT,
+                    &tstart[(size_t)i*IDIVC_NSLOT],
+                    &pmt[(size_t)i*IDIVC_NSLOT], &out[i]);
+      i += n;
+    }
+    npass++;
+  }while((seconds = (latency_now() - t0)*1e-9) < minseconds);
+
+  printf("All done working. Did each event %lu times.\n",
+         (unsigned long)npass);
+  printrate("Computed", npass*nevent,
+            double(npass)*nevent*IDIVC_NSLOT*(sizeof(double)+sizeof(short)),
+            seconds);
+}
+
+/* Runs one of --io-only, --compute-only and --no-write. */
+static int bench_main(const uint64_t first, const unsigned int maxevent,
+                      const char * const kernel,
+                      char ** const files, const int nfiles)
+{
+  if(mode != RUN_IOONLY) loadconsts();
+
+  const unsigned int nevent =
+    root_init_inputonly(first, maxevent, files, nfiles);
+
+  if(mode != RUN_IOONLY){
+    consts_cursor cursor = NOCONSTS;
+    choosekernel(kernel, first, nevent, consts_at(cursor, first));
+  }
+
+  if(mode == RUN_COMPUTEONLY){
+    compute_only_loop(first, nevent);
+  }
+  else{
+    idivc_source * const source = make_root_source(first, nevent);
+    read_only_loop(*source);
+    delete source;
+  }
+
+  root_finish();
+  return 0;
+}
+
 int main(int argc, char ** argv)
 {
   signal(SIGSEGV, on_segv_or_bus);
@@ -217,18 +1098,77 @@ int main(int argc, char ** argv)
   signal(SIGINT, endearly);
   signal(SIGHUP, endearly);
 
-  char * outfile = NULL, * timingfile = NULL;
+  if(argc > 1 && !strcmp(argv[1], "plan"))  return plan_main(argc-1, argv+1);
+  if(argc > 1 && !strcmp(argv[1], "merge")) return merge_main(argc-1, argv+1);
+  if(argc > 1 && !strcmp(argv[1], "produce"))
+    return produce_main(argc-1, argv+1);
+  if(argc > 1 && !strcmp(argv[1], "recal")) return recal_main(argc-1, argv+1);
+  if(argc > 1 && !strcmp(argv[1], "convert"))
+    return convert_main(argc-1, argv+1);
+
+  char * outfile = NULL, * timingfile = NULL, * kernel = NULL;
   bool clobber = false; // Whether to overwrite existing output
+  bool perfile = false; // Whether to write one output per input file
                          
+  uint64_t first = 0; // First event to process
   unsigned int maxevent = 0;
-  const int file1 =
-    handle_cmdline(argc, argv, clobber, maxevent, outfile, timingfile);
+  uint64_t prefetchmb = 0; // Read-ahead budget, or zero for none
+  bool latency = false; // Whether to time each event
+  bool counters = false; // Whether to read hardware counters
+  char * stream = NULL; // Where to read events from instead of base.root
+  unsigned int flushevery = 100; // How often to save the output with -S
+  char * candfile = NULL; // Where to save the earliest hits, if anywhere
+  const int file1 = handle_cmdline(argc, argv, clobber, perfile, first,
+                                   maxevent, outfile, timingfile, kernel,
+                                   prefetchmb, latency, counters, stream,
+                                   flushevery, candfile);
+
+  if(minhits > 1) set_event_filter(enough_hits);
+  if(prefetchmb) set_prefetch_budget(prefetchmb << 20);
+  set_skim(skim);
+  if(haveentryoffset) set_entry_offset(entryoffset);
+  set_quantize(timebits);
+  if(samplek) set_sampling(samplek);
+
+  if(mode != RUN_NORMAL)
+    return bench_main(first, maxevent, kernel, argv + file1, argc - file1);
+
+  loadconsts();
+  consts_cursor cursor = NOCONSTS;
+  const idivc_consts * const fido_consts = consts_at(cursor, first);
+
+  idivc_source * source;
+  if(stream){
+    root_init_stream(clobber, outfile, flushevery);
+    // Can't look ahead at a stream to benchmark on it
+    choosekernel(kernel && strcmp(kernel, "bench")? kernel: NULL, 0, 0,
+                 fido_consts);
+    // Save events that are waiting while no more are coming
+    source = make_stream_source(stream,
+                                flushevery? root_save_if_stale: NULL);
+  }
+  else{
+    // When sampling, -n applies to the events sampled
+    const unsigned int nevent = root_init(first, samplek? 0: maxevent,
+                                          clobber, perfile, outfile,
+                                          argv + file1, argc - file1);
+    choosekernel(kernel, first, nevent, fido_consts);
+    source = samplek? make_sampled_source(maxevent)
+                    : make_root_source(first, nevent);
+  }
+  if(savecands) root_init_candidates(candfile, fido_consts);
+  if(residualfile){
+    residuals = new idivc_residuals;
+    idivc_residuals_clear(residuals);
+  }
 
-  const double * const fido_consts = getfidoconsts(timingfile);
+  if(latency || counters)
+    doit_loop_instrumented(*source, latency, counters);
+  else
+    doit_loop(*source);
+  delete source;
 
-  const unsigned int nevent = root_init(maxevent, clobber, outfile, 
-                                        argv + file1, argc - file1);
-  doit_loop(nevent, fido_consts);
+  if(residuals) finish_residuals(fido_consts);
 
   root_finish();
   
@@ -0,0 +1,168 @@
+/**
+  \author Matthew Strait
+  \brief Reads the CPU's performance counters around each stage of each
+  event, to tell whether we are waiting on memory, mispredicting
+  branches, or just doing a lot of work.
+
+  Uses perf_event_open(2), counting only this process in user space, so
+  it works with the default perf_event_paranoid setting of 2. If the
+  kernel or a virtual machine doesn't give us some counter, we do
+  without it, and if it gives us none, we say so and carry on. If there
+  are more counters in use than the CPU has, the kernel takes turns
+  with them, and we scale the counts up by how long ours were running.
+*/
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum perf_counter { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHEMISSES,
+                    PERF_BRANCHMISSES, PERF_NCOUNTER };
+
+// Stages are the same as for the latency histograms
+static const int PERF_NSTAGE = 3;
+
+// How many numbers perf_read() gives: the time the counters were
+// enabled, the time they were actually counting, and the counts
+static const int PERF_NVALUE = 2 + PERF_NCOUNTER;
+
+namespace {
+  // File descriptor of each counter, or -1 if unavailable. The first
+  // available one leads the group, so that one read() gets them all.
+  int perffd[PERF_NCOUNTER];
+  int perfleader = -1;
+
+  // Position of each counter in what read() gives, or -1
+  int perfslot[PERF_NCOUNTER];
+  int perfnopen;
+
+  // Totals for each stage, and the time in ns that the counters were
+  // enabled and running during it
+  uint64_t perftotal[PERF_NSTAGE][PERF_NCOUNTER];
+  uint64_t perfenabled[PERF_NSTAGE], perfrunning[PERF_NSTAGE];
+};
+
+static int perf_open(const uint64_t config, const int group)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                   | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* Opens and starts the counters. Returns false if none are available,
+after saying why. */
+static bool initperf()
+{
+  const uint64_t configs[PERF_NCOUNTER] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+
+  memset(perftotal, 0, sizeof(perftotal));
+  memset(perfenabled, 0, sizeof(perfenabled));
+  memset(perfrunning, 0, sizeof(perfrunning));
+  int firsterrno = 0;
+  for(int c = 0; c < PERF_NCOUNTER; c++){
+    perfslot[c] = -1;
+    perffd[c] = perf_open(configs[c], perfleader);
+    if(perffd[c] < 0){
+      if(!firsterrno) firsterrno = errno;
+      continue;
+    }
+    if(perfleader < 0) perfleader = perffd[c];
+    perfslot[c] = perfnopen++;
+  }
+
+  if(perfleader < 0){
+    fprintf(stderr, "Hardware counters unavailable (%s). Continuing "
+            "without them.%s\n", strerror(firsterrno),
+            firsterrno == EACCES || firsterrno == EPERM?
+            " Check /proc/sys/kernel/perf_event_paranoid.": "");
+    return false;
+  }
+  if(perfnopen < PERF_NCOUNTER)
+    fprintf(stderr, "Only %d of %d hardware counters available (%s)\n",
+            perfnopen, PERF_NCOUNTER, strerror(firsterrno));
+
+  ioctl(perfleader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(perfleader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return true;
+}
+
+/* Reads all counters at once into v, which has room for PERF_NVALUE:
+the times enabled and running, then the counts in perfslot order. */
+static inline void perf_read(uint64_t * const v)
+{
+  uint64_t buf[1 + PERF_NVALUE];
+  if(read(perfleader, buf, sizeof(uint64_t)*(3 + perfnopen)) <= 0)
+    memset(buf, 0, sizeof(buf));
+  memcpy(v, buf + 1, sizeof(uint64_t)*(2 + perfnopen));
+}
+
+/* Adds the counts between two reads to the given stage. */
+static inline void perf_add(const int stage, const uint64_t * const before,
+                            const uint64_t * const after)
+{
+  perfenabled[stage] += after[0] - before[0];
+  perfrunning[stage] += after[1] - before[1];
+  for(int c = 0; c < PERF_NCOUNTER; c++)
+    if(perfslot[c] >= 0)
+      perftotal[stage][c] += after[2+perfslot[c]] - before[2+perfslot[c]];
+}
+
+static void printperf(const uint64_t nevent)
+{
+  if(perfleader < 0 || !nevent) return;
+
+  const char * const names[PERF_NSTAGE] = { "read", "compute", "write" };
+
+  // Scale up for the time that other users of the counters had them,
+  // assuming that each stage went on the same way meanwhile
+  double scale[PERF_NSTAGE];
+  for(int s = 0; s < PERF_NSTAGE; s++){
+    scale[s] = perfrunning[s]? double(perfenabled[s])/perfrunning[s]: 0;
+    if(perfrunning[s] < perfenabled[s])
+      fprintf(stderr, "Warning: hardware counters were shared with other "
+              "programs and only counted %.0f%% of the %s stage. Scaling "
+              "up to make up for it.\n",
+              100.0*perfrunning[s]/perfenabled[s], names[s]);
+  }
+
+  printf("Hardware counters per event:\n"
+         "%8s %12s %12s %6s %12s %12s\n",
+         "stage", "cycles", "instructions", "IPC", "cache miss",
+         "branch miss");
+  for(int s = 0; s < PERF_NSTAGE; s++){
+    printf("%8s", names[s]);
+    for(int c = 0; c < PERF_NCOUNTER; c++){
+      if(c == PERF_CACHEMISSES){
+        if(perfslot[PERF_CYCLES] >= 0 && perfslot[PERF_INSTRUCTIONS] >= 0
+           && perftotal[s][PERF_CYCLES])
+          printf(" %6.2f", double(perftotal[s][PERF_INSTRUCTIONS])
+                           /perftotal[s][PERF_CYCLES]);
+        else
+          printf(" %6s", "n/a");
+      }
+      if(perfslot[c] >= 0 && scale[s])
+        printf(" %12.1f", scale[s]*perftotal[s][c]/nevent);
+      else
+        printf(" %12s", "n/a");
+    }
+    printf("\n");
+  }
+
+  for(int c = 0; c < PERF_NCOUNTER; c++)
+    if(perffd[c] >= 0) close(perffd[c]);
+}
@@ -0,0 +1,168 @@
+/**
+  \author Matthew Strait
+  \brief Reads parts of a file in the background so that they are in
+  the page cache by the time ROOT wants them.
+*/
+
+using namespace std;
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE // for readahead()
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "idivc_prefetch.h"
+
+// Largest piece to read at once, so that we notice promptly when asked
+// to stop or to move on to another file.
+static const int64_t CHUNK = 8 << 20;
+
+namespace {
+  pthread_t thread;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+  // All protected by lock
+  bool running, quitting, havejob;
+  string jobfile;
+  vector<byterange> jobranges;
+
+  // Most bytes to read ahead for each file
+  uint64_t budget;
+};
+
+/* Whether the thread should drop what it is doing */
+static bool interrupted()
+{
+  pthread_mutex_lock(&lock);
+  const bool answer = quitting || havejob;
+  pthread_mutex_unlock(&lock);
+  return answer;
+}
+
+static void warm(const char * const filename,
+                 const vector<byterange> & ranges)
+{
+  // Fails for remote files, e.g. root://, which we can't help with
+  const int fd = open(filename, O_RDONLY);
+  if(fd < 0) return;
+
+  vector<char> buf;
+
+  for(unsigned int i = 0; i < ranges.size(); i++){
+    for(int64_t pos = ranges[i].start;
+        pos < ranges[i].start + ranges[i].len; pos += CHUNK){
+      if(interrupted()){
+        close(fd);
+        return;
+      }
+
+      const int64_t len = min(CHUNK, ranges[i].start + ranges[i].len - pos);
+
+      // readahead() blocks until the data is in the page cache. Some
+      // network file systems don't support it, so read it ourselves.
+      posix_fadvise(fd, pos, len, POSIX_FADV_WILLNEED);
+      if(readahead(fd, pos, len)){
+        buf.resize(len);
+        if(pread(fd, &buf[0], len, pos) < 0) break;
+      }
+    }
+  }
+
+  close(fd);
+}
+
+static void * prefetch_thread(__attribute__((unused)) void * dummy)
+{
+  pthread_mutex_lock(&lock);
+  while(true){
+    while(!havejob && !quitting) pthread_cond_wait(&wake, &lock);
+    if(quitting) break;
+
+    const string filename = jobfile;
+    vector<byterange> ranges;
+    ranges.swap(jobranges);
+    havejob = false;
+
+    pthread_mutex_unlock(&lock);
+    warm(filename.c_str(), ranges);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+static bool byoffset(const byterange & a, const byterange & b)
+{
+  return a.start < b.start;
+}
+
+/* Starts the background thread, which will read at most budget bytes
+of each file given to prefetch_file(). */
+void prefetch_start(const uint64_t budgetin)
+{
+  budget = budgetin;
+  quitting = havejob = false;
+  if(pthread_create(&thread, NULL, prefetch_thread, NULL)){
+    fprintf(stderr, "Could not start read-ahead thread. Continuing "
+            "without it.\n");
+    return;
+  }
+  running = true;
+}
+
+/* Asks the background thread to read the given parts of a file, most
+important first, up to the budget. Abandons any file it was working on
+before. */
+void prefetch_file(const char * const filename,
+                   const vector<byterange> & ranges)
+{
+  if(!running) return;
+
+  vector<byterange> job;
+  uint64_t total = 0;
+  for(unsigned int i = 0; i < ranges.size() && total < budget; i++){
+    if(ranges[i].len <= 0) continue;
+    job.push_back(ranges[i]);
+    if(total + ranges[i].len > budget) job.back().len = budget - total;
+    total += job.back().len;
+  }
+
+  // Read in file order, merging neighbors, to keep the disk happy
+  sort(job.begin(), job.end(), byoffset);
+  vector<byterange> merged;
+  for(unsigned int i = 0; i < job.size(); i++){
+    if(!merged.empty() &&
+       merged.back().start + merged.back().len >= job[i].start)
+      merged.back().len = max(merged.back().len,
+                              job[i].start + job[i].len - merged.back().start);
+    else
+      merged.push_back(job[i]);
+  }
+
+  pthread_mutex_lock(&lock);
+  jobfile = filename;
+  jobranges.swap(merged);
+  havejob = true;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+void prefetch_stop()
+{
+  if(!running) return;
+
+  pthread_mutex_lock(&lock);
+  quitting = true;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(thread, NULL);
+  running = false;
+}
@@ -0,0 +1,11 @@
+#include <stdint.h>
+#include <vector>
+
+struct byterange {
+  int64_t start, len;
+};
+
+void prefetch_start(const uint64_t budget);
+void prefetch_file(const char * const filename,
+                   const std::vector<byterange> & ranges);
+void prefetch_stop();
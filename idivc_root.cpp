@@ -8,28 +8,159 @@ using namespace std;
 #ifndef _GNU_SOURCE
   #define _GNU_SOURCE // for safe basename()
 #endif
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
 #include <vector>
+#include <algorithm>
 #include "TSystem.h"
 #include "TChain.h"
 #include "TFile.h"
 #include "TError.h"
 #include "TClonesArray.h"
+#include "TFileMerger.h"
+#include "TH1D.h"
+#include "TH2D.h"
+#include "TGraphErrors.h"
+#include "TNamed.h"
+#include "TParameter.h"
 #include "idivc_cont.h"
+#include "idivc_source.h"
+#include "idivc_root.h"
+#include "idivc_prefetch.h"
 
 
+// Compression of the output. Shards must be written with the same
+// setting for root_merge() not to have to recompress them.
+static const int OUTPUT_COMPRESSION = 9;
+
+// When saving the output as we go, also save it once events written
+// have waited this long, so that they don't wait for ever if events
+// come slowly
+static const double FLUSH_SECONDS = 1;
+
+// Range of times when they are stored with fewer bits. Valid times are
+// at most 999, and can be negative by as much as the most negative
+// timing constant, so leave plenty of room below zero. ROOT clamps
+// anything outside, so those are counted. Whether a time is valid is
+// stored separately, so -1 doesn't have to be stored exactly. The width
+// is a power of two so that the steps are too.
+static const int QUANT_TIMELO = -1024, QUANT_TIMEHI = 1024;
+
 namespace {
   idivc_input_event inevent;
   idivc_output_event outevent;
+  ULong64_t outentry;
+
+  // If nonzero, the number of bits to store times in, the PMT numbers
+  // and validity bits as stored then, and how many valid times didn't
+  // fit in the range
+  int timebits;
+  Short_t outidpmt, outivpmt;
+  UChar_t outvalid;
+  uint64_t nclamped;
+
+  // If nonzero, only every this many clusters of entries are processed
+  unsigned int samplek;
 
   vector<TTree *> hitchain;
+
+  // Entry number in the chain of the start of each TTree in hitchain,
+  // plus the total number of entries at the end.
   vector<uint64_t> hitchain_entries;
 
+  // The first event that will be processed
+  uint64_t firstevent;
+
+  // Whether the events written come from somewhere other than the
+  // input chain in order, as with streams and recal
+  bool notfromchain;
+
+  // Added to the entry numbers written, if given, so that those of
+  // jobs from a plan count from the start of the whole plan
+  uint64_t entryoffset;
+  bool haveentryoffset;
+
   // Needed for writing the output file
   TFile * outfile;
   TTree * recotree;
+  bool clobberoutput;
+
+  // Histograms of the events processed for outfile so far, including
+  // any skimmed out
+  idivc_summary summary;
+
+  // Which events to write, and the names of the choices, for the
+  // output's metadata
+  skim_type skim;
+  const char * const skimnames[] = { "none", "id", "iv", "both" };
+
+  // If nonzero, save the output tree every this many events so that
+  // readers can see it while we are still going, and when it was last
+  // saved, with how many
+  unsigned int flushevery;
+  double lastsavetime;
+  uint64_t nsaved;
+
+  // If writing one output file per input file, the file holding the
+  // TChain of all of them, the names of the output files so far, the
+  // index of the one being written and the number of entries written.
+  bool perfile;
+  TFile * manifestfile;
+  string outstem;
+  vector<string> perfilenames;
+  unsigned int curoutindex;
+  uint64_t nwritten;
+
+  // Optional user test of whether an event is worth reading times for,
+  // and the number of events whose times we didn't read.
+  event_filter eventfilter;
+  uint64_t ntimesskipped;
+
+  // Whether to read the next input file ahead in the background
+  bool prefetching;
+
+  // The earliest hits of each event, for recalibrating without
+  // base.root, and the entry number of the event they came from.
+  // candfile is being either written or read.
+  TFile * candfile;
+  bool candwriting;
+  TTree * candtree;
+  idivc_candidates candevent;
+  ULong64_t candentry;
 }; 
 
+/* Asks for the hit baskets of hitchain[i] to be read ahead, earliest
+entries first, so that we don't stall when we get to it. */
+static void prefetch_tree(const unsigned int i)
+{
+  const char * const names[2] = { "PulseSlideWinInfoBranch.fPMTNum",
+                                  "PulseSlideWinInfoBranch.fTstart_raw" };
+  TBranch * branches[2];
+  for(int b = 0; b < 2; b++)
+    if(!(branches[b] = hitchain[i]->GetBranch(names[b]))) return;
+
+  // Alternate between the branches so that if the budget runs out, we
+  // have the same span of entries for both.
+  vector<byterange> ranges;
+  for(int basket = 0; ; basket++){
+    bool any = false;
+    for(int b = 0; b < 2; b++){
+      if(basket >= branches[b]->GetWriteBasket()) continue;
+      const byterange r = { branches[b]->GetBasketSeek(basket),
+                            branches[b]->GetBasketBytes()[basket] };
+      ranges.push_back(r);
+      any = true;
+    }
+    if(!any) break;
+  }
+
+  prefetch_file(hitchain[i]->GetCurrentFile()->GetName(), ranges);
+}
+
+
 static void get_hits(const uint64_t current_event)
 {
   // Go through some contortions for speed. Favor TBranch::GetEntry over
@@ -38,19 +169,18 @@ static void get_hits(const uint64_t current_event)
   static TBranch * tbranch = 0, * pbranch = 0;
 
   static uint64_t offset = 0, nextbreak = 0;
-
-  // This allows reading randomly around in the current TTree or
-  // resetting to the first TTree, but random reads from one TTree to
-  // another will fail catastrophically.
-  if(current_event == 0 || current_event == nextbreak){
-    static TTree * curtree = 0;
-    static int curtreeindex = -1;
-    if(current_event == 0){
-      offset = nextbreak = 0;
-      curtreeindex = -1;
-    }
-
-    curtree = hitchain[++curtreeindex];
+  static int curtreeindex = -1;
+
+  // Find the TTree holding this event if it isn't the current one. This
+  // allows reading randomly, but it is only fast to read in order.
+  if(curtreeindex < 0 || current_event < offset ||
+     current_event >= nextbreak){
+    // The last TTree starting at or before this event. Skips empty ones.
+    curtreeindex = upper_bound(hitchain_entries.begin(),
+                               hitchain_entries.end(), current_event)
+                   - hitchain_entries.begin() - 1;
+
+    TTree * const curtree = hitchain[curtreeindex];
     nextbreak = hitchain_entries[curtreeindex+1];
     offset = hitchain_entries[curtreeindex];
 
@@ -61,27 +191,360 @@ static void get_hits(const uint64_t current_event)
     curtree->SetBranchAddress("PulseSlideWinInfoBranch", &dummy);
     curtree->SetBranchAddress("PulseSlideWinInfoBranch.fTstart_raw", inevent.tstart);
     curtree->SetBranchAddress("PulseSlideWinInfoBranch.fPMTNum", inevent.pmt);
+
+    if(prefetching && curtreeindex+1 < int(hitchain.size()))
+      prefetch_tree(curtreeindex+1);
   }
 
+  // Starting over, as after a -k bench run, so start counting again
+  if(current_event == firstevent) ntimesskipped = 0;
+
   const uint64_t localentry = current_event - offset;
 
-  tbranch->GetEntry(localentry);
+  // The times are most of the bytes, and are useless if no hit is in a
+  // PMT we know about, which is common in noise and calibration runs,
+  // so look at the PMT numbers first. Leaving the times zero makes
+  // doit() ignore every hit.
   pbranch->GetEntry(localentry);
+
+  bool usable = false;
+  for(int i = 0; i < IDIVC_NSLOT; i++)
+    if(inevent.pmt[i] >= 0 && inevent.pmt[i] < IDIVC_NPMT){
+      usable = true;
+      break;
+    }
+
+  if(usable && (!eventfilter || eventfilter(current_event, inevent.pmt)))
+    tbranch->GetEntry(localentry);
+  else
+    ntimesskipped++;
 }
 
 /** Make inevent the eventn'th event in the chain. */
 idivc_input_event get_event(const uint64_t current_event)
 {
-  memset(&inevent, 0, sizeof(inevent));
+  // Unfilled PMT slots are -1, not 0, so they don't look like hits in
+  // PMT 0 when get_hits() decides whether to read the times.
+  memset(inevent.tstart, 0, sizeof(inevent.tstart));
+  memset(inevent.pmt, 0xff, sizeof(inevent.pmt));
   get_hits(current_event);
 
   return inevent;
 }
 
-void write_event(const idivc_output_event & out)
+static TFile * open_output_file(const char * const outfilename)
+{
+  TFile * const f = new TFile(outfilename, clobberoutput?"RECREATE":"CREATE",
+                              "", OUTPUT_COMPRESSION);
+
+  if(!f || f->IsZombie()){
+    fprintf(stderr, "Could not open output file %s. Does it exist?  "
+            "Use -c to overwrite existing output.\n", outfilename);
+    exit(1);
+  }
+  return f;
+}
+
+/* Makes recotree in the current directory, which should be outfile. */
+static void make_recotree()
+{
+  // Name and title same as in old EnDep code
+  recotree = new TTree("idivc", "ID and IV time correction tree tree");
+
+  if(timebits){
+    // Float16_t with a range, and PMT numbers fit in a Short_t
+    char leaf[64];
+    snprintf(leaf, sizeof(leaf), "timeid/f[%d,%d,%d]", QUANT_TIMELO,
+             QUANT_TIMEHI, timebits);
+    recotree->Branch("timeid", &outevent.timeid, leaf);
+    snprintf(leaf, sizeof(leaf), "timeiv/f[%d,%d,%d]", QUANT_TIMELO,
+             QUANT_TIMEHI, timebits);
+    recotree->Branch("timeiv", &outevent.timeiv, leaf);
+    recotree->Branch("firstidpmt", &outidpmt, "firstidpmt/S");
+    recotree->Branch("firstivpmt", &outivpmt, "firstivpmt/S");
+    recotree->Branch("valid", &outvalid, "valid/b");
+
+    TList * const info = recotree->GetUserInfo();
+    info->Add(new TParameter<int>("timebits", timebits));
+    info->Add(new TParameter<double>("timeprecision",
+      double(QUANT_TIMEHI - QUANT_TIMELO)/(1u << timebits)));
+  }
+  else{
+    recotree->Branch("timeid", &outevent.timeid);
+    recotree->Branch("timeiv", &outevent.timeiv);
+    recotree->Branch("firstidpmt", &outevent.firstidpmt);
+    recotree->Branch("firstivpmt", &outevent.firstivpmt);
+  }
+
+  // Unless the output has one entry for each in the chain of base.root
+  // files given to this job, starting from its first, say where each
+  // event came from. The entry numbers count from the start of that
+  // chain, plus any offset. Jobs from a plan are all given an offset,
+  // so that they all have the branch and can be merged.
+  if(firstevent || notfromchain || haveentryoffset || skim != SKIM_NONE ||
+     samplek)
+    recotree->Branch("entry", &outentry, "entry/l");
+  if(skim != SKIM_NONE)
+    recotree->GetUserInfo()->Add(new TNamed("skim", skimnames[skim]));
+  if(samplek)
+    recotree->GetUserInfo()->Add(new TParameter<int>("sample", samplek));
+}
+
+/* Makes a histogram out of one of the arrays in an idivc_summary,
+which has underflow and overflow bins like ROOT's. */
+static void write_summary_hist(const char * const name,
+                               const char * const title,
+                               const uint64_t * const counts,
+                               const int nbin, const double lo,
+                               const double hi, const bool underover)
+{
+  TH1D h(name, title, nbin, lo, hi);
+  double entries = 0;
+  for(int i = 0; i < nbin + 2*underover; i++){
+    h.SetBinContent(i + !underover, counts[i]);
+    entries += counts[i];
+  }
+  h.SetEntries(entries);
+  h.Write();
+}
+
+/* Writes histograms of the output to outfile next to the idivc tree,
+so that data quality checks don't need another pass. */
+static void write_summary()
+{
+  TH1D counts("idivc_counts", "idivc event counts", 4, 0, 4);
+  const char * const labels[4] = { "events", "ID valid", "IV valid",
+                                   "both valid" };
+  const uint64_t values[4] = { summary.nevent, summary.nidvalid,
+                               summary.nivvalid, summary.nbothvalid };
+  for(int i = 0; i < 4; i++){
+    counts.GetXaxis()->SetBinLabel(i+1, labels[i]);
+    counts.SetBinContent(i+1, values[i]);
+  }
+  counts.SetEntries(summary.nevent);
+  counts.Write();
+
+  write_summary_hist("idivc_timeid", "timeid;timeid (ns);events",
+                     summary.timeid, IDIVC_SUM_NTIMEBIN,
+                     IDIVC_SUM_TIMELO, IDIVC_SUM_TIMEHI, true);
+  write_summary_hist("idivc_timeiv", "timeiv;timeiv (ns);events",
+                     summary.timeiv, IDIVC_SUM_NTIMEBIN,
+                     IDIVC_SUM_TIMELO, IDIVC_SUM_TIMEHI, true);
+  write_summary_hist("idivc_timediff",
+                     "timeid - timeiv;timeid - timeiv (ns);events",
+                     summary.timediff, IDIVC_SUM_NDIFFBIN,
+                     IDIVC_SUM_DIFFLO, IDIVC_SUM_DIFFHI, true);
+  write_summary_hist("idivc_firstidpmt", "firstidpmt;PMT;events",
+                     summary.firstidpmt, IDIVC_NPMT, 0, IDIVC_NPMT, false);
+  write_summary_hist("idivc_firstivpmt", "firstivpmt;PMT;events",
+                     summary.firstivpmt, IDIVC_NPMT, 0, IDIVC_NPMT, false);
+
+  idivc_summary_clear(&summary);
+}
+
+/* Writes per-PMT histograms of hit times relative to the first hit to
+the output file. Call before root_finish(). */
+void write_residuals(const idivc_residuals & res)
+{
+  TDirectory * const wasin = gDirectory;
+  outfile->cd();
+
+  TH2D h("idivc_residuals",
+         "Hit time minus first hit time;PMT;residual (ns);hits",
+         IDIVC_NPMT, 0, IDIVC_NPMT,
+         IDIVC_RES_NBIN, IDIVC_RES_LO, IDIVC_RES_HI);
+  double entries = 0;
+  for(int p = 0; p < IDIVC_NPMT; p++)
+    for(int b = 0; b < IDIVC_RES_NBIN + 2; b++){
+      h.SetBinContent(p+1, b, res.counts[p][b]);
+      entries += res.counts[p][b];
+    }
+  h.SetEntries(entries);
+  h.Write();
+
+  wasin->cd();
+}
+
+static void close_output_file()
+{
+  outfile->cd();
+  recotree->Write();
+  write_summary();
+  outfile->Close();
+}
+
+/* Opens the output file to go with input file number i, which will
+have the same number of entries. */
+static void open_perfile_output(const unsigned int i)
+{
+  char name[1024];
+  snprintf(name, sizeof(name), "%s_%04u.root", outstem.c_str(), i);
+
+  outfile = open_output_file(name);
+  make_recotree();
+
+  // The manifest's TChain looks for files relative to wherever it is
+  // read from, so give it the full path
+  char * const fullname = realpath(name, NULL);
+  perfilenames.push_back(fullname? fullname: name);
+  free(fullname);
+  curoutindex = i;
+}
+
+static double now()
 {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+static void save_output()
+{
+  recotree->AutoSave("SaveSelf;FlushBaskets");
+  nsaved = nwritten;
+  lastsavetime = now();
+}
+
+/* If saving the output as we go, saves it if any events written since
+the last save have waited long enough. For calling while waiting for
+events, as well as after each one. */
+void root_save_if_stale()
+{
+  if(flushevery && nwritten > nsaved && now() - lastsavetime >= FLUSH_SECONDS)
+    save_output();
+}
+
+void write_event(const idivc_output_event & out, const uint64_t entry)
+{
+  // Move on to the next output file, or several if some input files
+  // were empty, when we cross into the next input file.
+  if(perfile)
+    while(nwritten == hitchain_entries[curoutindex+1]){
+      close_output_file();
+      open_perfile_output(curoutindex+1);
+    }
+
+  idivc_summary_add(&summary, &out, 1);
+
+  if(((skim == SKIM_ID || skim == SKIM_BOTH) && !idivc_id_valid(&out)) ||
+     ((skim == SKIM_IV || skim == SKIM_BOTH) && !idivc_iv_valid(&out))){
+    root_save_if_stale();
+    return;
+  }
+
+  if(timebits){
+    nclamped += idivc_id_valid(&out) &&
+                (out.timeid < QUANT_TIMELO || out.timeid > QUANT_TIMEHI);
+    nclamped += idivc_iv_valid(&out) &&
+                (out.timeiv < QUANT_TIMELO || out.timeiv > QUANT_TIMEHI);
+  }
+
   outevent = out;
+  outentry = entryoffset + entry;
+  outidpmt = out.firstidpmt;
+  outivpmt = out.firstivpmt;
+  outvalid = out.valid;
   recotree->Fill();
+  nwritten++;
+
+  if(flushevery && nwritten - nsaved >= flushevery) save_output();
+  else root_save_if_stale();
+}
+
+/* Makes candtree in the current directory, or sets it up to be read
+if it is already there. */
+static void candtree_branches()
+{
+  if(!candtree){
+    candtree = new TTree("idivc_cand", "Earliest hits of each event");
+    candtree->Branch("entry", &candentry, "entry/l");
+    candtree->Branch("ncand", &candevent.n, "ncand/I");
+    candtree->Branch("tstart", candevent.tstart, "tstart[ncand]/D");
+    candtree->Branch("pmt", candevent.pmt, "pmt[ncand]/S");
+    candtree->Branch("limitid", &candevent.limitid, "limitid/D");
+    candtree->Branch("limitiv", &candevent.limitiv, "limitiv/D");
+    char leaf[64];
+    snprintf(leaf, sizeof(leaf), "leftout[%d]/b", IDIVC_PMTMASK);
+    candtree->Branch("leftout", candevent.leftout, leaf);
+    return;
+  }
+  candtree->SetBranchAddress("entry", &candentry);
+  candtree->SetBranchAddress("ncand", &candevent.n);
+  candtree->SetBranchAddress("tstart", candevent.tstart);
+  candtree->SetBranchAddress("pmt", candevent.pmt);
+  candtree->SetBranchAddress("limitid", &candevent.limitid);
+  candtree->SetBranchAddress("limitiv", &candevent.limitiv);
+  candtree->SetBranchAddress("leftout", candevent.leftout);
+}
+
+/* Opens a file to save the earliest hits of each event in, along with
+the constants they were found with. The constants are saved in the same
+form as in a timing file, so the file can be given as one. */
+void root_init_candidates(const char * const filename,
+                          const idivc_consts * const consts)
+{
+  TDirectory * const wasin = gDirectory;
+  candfile = open_output_file(filename);
+  candwriting = true;
+
+  double pmt[IDIVC_NPMT], t0[IDIVC_NPMT], zero[IDIVC_NPMT],
+         err[IDIVC_NPMT];
+  for(int i = 0; i < IDIVC_NPMT; i++){
+    pmt[i] = i;
+    t0[i] = idivc_consts_get(consts, i);
+    zero[i] = 0;
+    err[i] = 0.5; // anything that idivc_consts_add_fit() will take
+  }
+  TGraphErrors g(IDIVC_NPMT, pmt, t0, zero, err);
+  g.Write("finalt0table_caliter01");
+
+  candtree_branches();
+  wasin->cd();
+}
+
+void write_candidates(const idivc_candidates & cand, const uint64_t entry)
+{
+  candevent = cand;
+  candentry = entry;
+  candtree->Fill();
+}
+
+/* Opens a file written with root_init_candidates() for reading and
+returns how many events it has. */
+uint64_t root_open_candidates(const char * const filename)
+{
+  candfile = new TFile(filename, "read");
+  if(!candfile || candfile->IsZombie() ||
+     !(candtree = dynamic_cast<TTree *>(candfile->Get("idivc_cand")))){
+    fprintf(stderr, "Could not read candidate hits from %s\n", filename);
+    exit(1);
+  }
+  if(!candtree->GetBranch("leftout")){
+    fprintf(stderr, "%s was made by an older idivc. Please make it again "
+            "with -C.\n", filename);
+    exit(1);
+  }
+  candtree_branches();
+  return candtree->GetEntries();
+}
+
+/* Gets the candidates of the i'th event of the file opened with
+root_open_candidates() and the entry number in base.root it came from. */
+void get_candidates(const uint64_t i, idivc_candidates & cand,
+                    uint64_t & entry)
+{
+  candtree->GetEntry(i);
+  cand = candevent;
+  entry = candentry;
+}
+
+static void close_candidates()
+{
+  if(candwriting){
+    candfile->cd();
+    candtree->Write();
+  }
+  candfile->Close();
 }
 
 static uint64_t root_init_input(const char * const * const filenames,
@@ -125,39 +588,143 @@ static uint64_t root_init_input(const char * const * const filenames,
     printf("Loaded %s\n", fname);
   }
 
+  hitchain_entries.push_back(totentries_hit);
+
   return totentries_hit;
 }
 
-static void root_init_output(const bool clobber,
-                             const char * const outfilename)
+static void root_init_output(const char * const outfilename)
 {
-  outfile = new TFile(outfilename, clobber?"RECREATE":"CREATE","",9);
+  outfile = open_output_file(outfilename);
+  make_recotree();
+}
 
-  if(!outfile || outfile->IsZombie()){
-    fprintf(stderr, "Could not open output file %s. Does it exist?  "
-            "Use -c to overwrite existing output.\n", outfilename);
-    exit(1);
+/* Sets up writing one output file per input file. The file named by
+the user gets a TChain of them all, so it can be used as a friend of a
+TChain of the input files. The rest are named after it with a suffix. */
+static void root_init_perfile_output(const char * const outfilename)
+{
+  manifestfile = open_output_file(outfilename);
+
+  outstem = outfilename;
+  if(outstem.size() > 5 && outstem.substr(outstem.size()-5) == ".root")
+    outstem.resize(outstem.size()-5);
+
+  open_perfile_output(0);
+}
+
+static void root_finish_perfile()
+{
+  close_output_file();
+
+  // Make output for any empty input files at the end, unless we
+  // stopped early, in which case alignment is lost anyway.
+  if(nwritten == hitchain_entries.back()){
+    while(curoutindex+1 < hitchain.size()){
+      open_perfile_output(curoutindex+1);
+      close_output_file();
+    }
+  }
+  else{
+    fprintf(stderr, "Warning: stopped early, so %s is shorter than its "
+            "input file and later input files have no output\n",
+            perfilenames.back().c_str());
   }
 
-  // Name and title same as in old EnDep code
-  recotree = new TTree("idivc", "ID and IV time correction tree tree");
+  manifestfile->cd();
+  TChain manifest("idivc", "ID and IV time correction tree tree");
+  for(unsigned int i = 0; i < perfilenames.size(); i++){
+    const uint64_t n = i+1 < perfilenames.size()
+      ? hitchain_entries[i+1] - hitchain_entries[i]
+      : nwritten - hitchain_entries[i];
+    manifest.Add(perfilenames[i].c_str(), n);
+  }
+  manifest.Write();
+  manifestfile->Close();
+}
 
-  recotree->Branch("timeid", &outevent.timeid);
-  recotree->Branch("timeiv", &outevent.timeiv);
-  recotree->Branch("firstidpmt", &outevent.firstidpmt);
-  recotree->Branch("firstivpmt", &outevent.firstivpmt);
+void set_event_filter(const event_filter filter)
+{
+  eventfilter = filter;
+}
+
+/* Store times as Float16_t with this many bits, and PMT numbers as
+Short_t. Must be called before the output is opened. */
+void set_quantize(const int bits)
+{
+  timebits = bits;
+}
+
+/* Add offset to the entry numbers written, and always write them. Must
+be called before the output is opened. */
+void set_entry_offset(const uint64_t offset)
+{
+  entryoffset = offset;
+  haveentryoffset = true;
+}
+
+/* Write only some events, with their entry numbers. Must be called
+before the output is opened. */
+void set_skim(const skim_type s)
+{
+  skim = s;
+}
+
+/* Turns on reading the next input file ahead in the background, at
+most budget bytes of it. */
+void set_prefetch_budget(const uint64_t budget)
+{
+  prefetch_start(budget);
+  prefetching = true;
 }
 
 void root_finish()
 {
+  if(prefetching) prefetch_stop();
+
+  if(ntimesskipped)
+    printf("Didn't read times for %lu events with no usable PMTs or "
+           "that were filtered out\n",
+           (unsigned long)ntimesskipped);
+
+  if(nclamped)
+    fprintf(stderr, "Warning: %lu times were outside %d to %d ns and were "
+            "stored as the nearest end of that range\n",
+            (unsigned long)nclamped, QUANT_TIMELO, QUANT_TIMEHI);
+
   gErrorIgnoreLevel = kError;
-  outfile->cd();
-  recotree->Write();
-  outfile->Close();
+  if(candfile)    close_candidates();
+  if(perfile)     root_finish_perfile();
+  else if(outfile) close_output_file();
+}
+
+/* Opens the input files, checks that there are at least first+1 events
+and returns how many to process. */
+static uint64_t root_init_range(const uint64_t first, const uint64_t maxevent,
+                                const char * const * const infiles,
+                                const int nfiles)
+{
+  firstevent = first;
+
+  const uint64_t nevents = root_init_input(infiles, nfiles);
+
+  // Starting at the beginning of no events at all is fine, and gives
+  // empty output
+  if(first >= nevents && first > 0){
+    fprintf(stderr, "Asked to start at event %lu, but there are only %lu\n",
+            (unsigned long)first, (unsigned long)nevents);
+    exit(1);
+  }
+
+  uint64_t neventstouse = nevents - first;
+  if(maxevent && neventstouse > maxevent) neventstouse = maxevent;
+
+  return neventstouse;
 }
 
 /* Sets up the ROOT input and output. */
-uint64_t root_init(const uint64_t maxevent, const bool clobber,
+uint64_t root_init(const uint64_t first, const uint64_t maxevent,
+                   const bool clobber, const bool perfileout,
                    const char * const outfilenm,
                    const char * const * const infiles, const int nfiles)
 {
@@ -167,11 +734,267 @@ uint64_t root_init(const uint64_t maxevent, const bool clobber,
   // let ROOT spew about that.
   gErrorIgnoreLevel = kError; 
 
-  root_init_output(clobber, outfilenm);
+  clobberoutput = clobber;
+  perfile = perfileout;
+  firstevent = first;
 
-  const uint64_t nevents = root_init_input(infiles, nfiles);
-  uint64_t neventstouse = nevents;
-  if(maxevent && nevents > maxevent) neventstouse = maxevent;
+  // The per-file output needs to know about the input files, but
+  // otherwise open the output first so that we fail fast if it exists.
+  if(!perfile) root_init_output(outfilenm);
+
+  const uint64_t neventstouse =
+    root_init_range(first, maxevent, infiles, nfiles);
+
+  if(perfile) root_init_perfile_output(outfilenm);
 
   return neventstouse;
 }
+
+/* Sets up only the ROOT input, for passing events on to someone else. */
+uint64_t root_init_inputonly(const uint64_t first, const uint64_t maxevent,
+                             const char * const * const infiles,
+                             const int nfiles)
+{
+  gErrorIgnoreLevel = kError;
+  return root_init_range(first, maxevent, infiles, nfiles);
+}
+
+/* Sets up only the ROOT output, for events that come from somewhere
+else, saving the tree every flush events so that it can be read as we
+go. */
+void root_init_stream(const bool clobber, const char * const outfilenm,
+                      const unsigned int flush)
+{
+  gErrorIgnoreLevel = kError;
+  clobberoutput = clobber;
+  flushevery = flush;
+  lastsavetime = now();
+  notfromchain = true;
+  root_init_output(outfilenm);
+}
+
+class root_source : public idivc_source {
+  public:
+  root_source(const uint64_t first, const uint64_t n)
+    : cur(first), end(first + n), n(n) {}
+
+  bool next(idivc_input_event & ev, uint64_t & entry)
+  {
+    if(cur >= end) return false;
+    entry = cur;
+    ev = get_event(cur++);
+    return true;
+  }
+
+  uint64_t size() const { return n; }
+
+  private:
+  uint64_t cur, end, n;
+};
+
+/* Gives the events of some ranges of entries, in order. */
+class sampled_source : public idivc_source {
+  public:
+  sampled_source(const vector< pair<uint64_t, uint64_t> > & ranges,
+                 const uint64_t maxevent)
+    : ranges(ranges), r(0), cur(ranges.empty()? 0: ranges[0].first),
+      given(0)
+  {
+    n = 0;
+    for(unsigned int i = 0; i < ranges.size(); i++)
+      n += ranges[i].second - ranges[i].first;
+    if(maxevent && n > maxevent) n = maxevent;
+  }
+
+  bool next(idivc_input_event & ev, uint64_t & entry)
+  {
+    if(given == n) return false;
+    while(cur >= ranges[r].second) cur = ranges[++r].first;
+    entry = cur;
+    ev = get_event(cur++);
+    given++;
+    return true;
+  }
+
+  uint64_t size() const { return n; }
+
+  private:
+  vector< pair<uint64_t, uint64_t> > ranges;
+  unsigned int r;
+  uint64_t cur, given, n;
+};
+
+/* Process only every k'th cluster of entries, counting across all the
+input files, and mark the output with k. Must be called before
+root_init(). */
+void set_sampling(const unsigned int k)
+{
+  samplek = k;
+}
+
+/* Returns a source of the events in every k'th cluster of entries, as
+set with set_sampling(), or the first maxevent of those if it is
+nonzero. Since a cluster's entries are in the same baskets, only those
+baskets are read. */
+idivc_source * make_sampled_source(const uint64_t maxevent)
+{
+  vector< pair<uint64_t, uint64_t> > ranges;
+  uint64_t ncluster = 0, nentry = 0;
+  for(unsigned int i = 0; i < hitchain.size(); i++){
+    const Long64_t n = hitchain[i]->GetEntries();
+    TTree::TClusterIterator clusters = hitchain[i]->GetClusterIterator(0);
+    Long64_t start;
+    while((start = clusters.Next()) < n){
+      const Long64_t end = clusters.GetNextEntry() < n?
+                           clusters.GetNextEntry(): n;
+      if(ncluster++ % samplek == 0){
+        ranges.push_back(make_pair(hitchain_entries[i] + start,
+                                   hitchain_entries[i] + end));
+        nentry += end - start;
+      }
+    }
+  }
+
+  printf("Sampling 1 of every %u clusters: %lu of %lu events\n", samplek,
+         (unsigned long)nentry, (unsigned long)hitchain_entries.back());
+  return new sampled_source(ranges, maxevent);
+}
+
+/* Returns a source of n events from the chain, starting with first. */
+idivc_source * make_root_source(const uint64_t first, const uint64_t n)
+{
+  return new root_source(first, n);
+}
+
+/* Splits the input files into nshards pieces with about the same number
+of compressed bytes of hits to read, and writes one line per piece to
+the file planname giving the -s and -n options and file names to pass
+to idivc to process it. */
+void root_plan_shards(const int nshards, const bool clobber,
+                      const char * const planname,
+                      const char * const * const infiles, const int nfiles)
+{
+  gErrorIgnoreLevel = kError;
+
+  if(!clobber && !access(planname, F_OK)){
+    fprintf(stderr, "%s exists. Use -c to overwrite it.\n", planname);
+    exit(1);
+  }
+
+  root_init_input(infiles, nfiles);
+
+  // Cumulative compressed size of the hit branches at the start of each
+  // file, and at the end
+  vector<double> startbytes(1, 0);
+  for(unsigned int i = 0; i < hitchain.size(); i++){
+    TBranch * const tb =
+      hitchain[i]->GetBranch("PulseSlideWinInfoBranch.fTstart_raw");
+    TBranch * const pb =
+      hitchain[i]->GetBranch("PulseSlideWinInfoBranch.fPMTNum");
+    if(!tb || !pb){
+      fprintf(stderr, "%s is missing the hit branches\n", infiles[i]);
+      exit(1);
+    }
+    startbytes.push_back(startbytes.back()
+                         + tb->GetZipBytes() + pb->GetZipBytes());
+  }
+
+  FILE * const plan = fopen(planname, "w");
+  if(!plan){
+    fprintf(stderr, "Could not open %s for writing\n", planname);
+    exit(1);
+  }
+
+  // Assume the bytes of each file are spread evenly over its events
+  uint64_t start = 0;
+  int nwritten = 0;
+  for(int s = 0; s < nshards; s++){
+    uint64_t end = hitchain_entries.back();
+    if(s+1 < nshards){
+      const double target = startbytes.back()*(s+1)/nshards;
+      const unsigned int f = upper_bound(startbytes.begin(),
+                                         startbytes.end()-1, target)
+                             - startbytes.begin() - 1;
+      const uint64_t fentries = hitchain_entries[f+1] - hitchain_entries[f];
+      end = hitchain_entries[f];
+      if(fentries){
+        const double perevent = (startbytes[f+1] - startbytes[f])/fentries;
+        end += uint64_t((target - startbytes[f])/perevent + 0.5);
+        if(end > hitchain_entries[f+1]) end = hitchain_entries[f+1];
+      }
+    }
+
+    if(end <= start) continue;
+
+    // Files that this shard touches, first to last
+    const unsigned int firstfile =
+      upper_bound(hitchain_entries.begin(), hitchain_entries.end(), start)
+      - hitchain_entries.begin() - 1;
+    const unsigned int lastfile =
+      upper_bound(hitchain_entries.begin(), hitchain_entries.end(), end-1)
+      - hitchain_entries.begin() - 1;
+
+    fprintf(plan, "-s %lu -n %lu --entry-offset %lu",
+            (unsigned long)(start - hitchain_entries[firstfile]),
+            (unsigned long)(end - start),
+            (unsigned long)hitchain_entries[firstfile]);
+    for(unsigned int f = firstfile; f <= lastfile; f++)
+      fprintf(plan, " %s", infiles[f]);
+    fprintf(plan, "\n");
+
+    nwritten++;
+    start = end;
+  }
+
+  fclose(plan);
+
+  printf("Wrote %d shards to %s\n", nwritten, planname);
+}
+
+/* Concatenates the output of several idivc jobs into outfilename in the
+order given. Baskets are copied without recompressing them. */
+void root_merge(const bool clobber, const char * const outfilename,
+                const char * const * const infiles, const int nfiles)
+{
+  gErrorIgnoreLevel = kError;
+
+  TFileMerger merger(false);
+  merger.SetFastMethod(true);
+
+  if(!merger.OutputFile(outfilename, clobber?"RECREATE":"CREATE",
+                        OUTPUT_COMPRESSION)){
+    fprintf(stderr, "Could not open output file %s. Does it exist?  "
+            "Use -c to overwrite existing output.\n", outfilename);
+    exit(1);
+  }
+
+  uint64_t totentries = 0;
+  for(int i = 0; i < nfiles; i++){
+    TFile * const f = new TFile(infiles[i], "read");
+    if(!f || f->IsZombie()){
+      fprintf(stderr, "%s became a zombie when ROOT tried to read it.\n",
+              infiles[i]);
+      exit(1);
+    }
+    TTree * const t = dynamic_cast<TTree*>(f->Get("idivc"));
+    if(!t){
+      fprintf(stderr, "%s does not have an idivc tree\n", infiles[i]);
+      exit(1);
+    }
+    totentries += t->GetEntries();
+    delete f;
+
+    if(!merger.AddFile(infiles[i], false)){
+      fprintf(stderr, "Could not add %s to the merge\n", infiles[i]);
+      exit(1);
+    }
+  }
+
+  if(!merger.Merge()){
+    fprintf(stderr, "Failed to merge into %s\n", outfilename);
+    exit(1);
+  }
+
+  printf("Merged %lu entries from %d files into %s\n",
+         (unsigned long)totentries, nfiles, outfilename);
+}
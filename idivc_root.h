@@ -1,7 +1,43 @@
+/* A test of whether an event should be processed, given its entry number
+in the chain and the PMT numbers of its hits, before any times are read.
+Events that fail get the same output as an event with no hits. */
+typedef bool (*event_filter)(const uint64_t entry, const short * const pmt);
+
+/* Which events to write: all, or only those with a valid ID time, IV
+time or both. */
+enum skim_type { SKIM_NONE, SKIM_ID, SKIM_IV, SKIM_BOTH };
+
 idivc_input_event get_event(const uint64_t current_event);
-uint64_t root_init(const uint64_t maxevent, const bool clobber,
+uint64_t root_init(const uint64_t first, const uint64_t maxevent,
+                   const bool clobber, const bool perfile,
                    const char * const outfile,
                    const char * const * const infiles,
                    const int nfiles);
-void write_event(const idivc_output_event & out);
+uint64_t root_init_inputonly(const uint64_t first, const uint64_t maxevent,
+                             const char * const * const infiles,
+                             const int nfiles);
+void root_init_stream(const bool clobber, const char * const outfile,
+                      const unsigned int flush);
+idivc_source * make_root_source(const uint64_t first, const uint64_t n);
+void write_event(const idivc_output_event & out, const uint64_t entry);
+void root_save_if_stale();
 void root_finish();
+void set_event_filter(const event_filter filter);
+void set_skim(const skim_type skim);
+void set_entry_offset(const uint64_t offset);
+void set_quantize(const int timebits);
+void set_sampling(const unsigned int k);
+void write_residuals(const idivc_residuals & res);
+idivc_source * make_sampled_source(const uint64_t maxevent);
+void root_plan_shards(const int nshards, const bool clobber,
+                      const char * const planname,
+                      const char * const * const infiles, const int nfiles);
+void root_merge(const bool clobber, const char * const outfilename,
+                const char * const * const infiles, const int nfiles);
+void set_prefetch_budget(const uint64_t budget);
+void root_init_candidates(const char * const filename,
+                          const idivc_consts * const consts);
+void write_candidates(const idivc_candidates & cand, const uint64_t entry);
+uint64_t root_open_candidates(const char * const filename);
+void get_candidates(const uint64_t i, idivc_candidates & cand,
+                    uint64_t & entry);
@@ -0,0 +1,13 @@
+/* Where events come from. The ROOT chain of base.root files is one
+source; a stream of framed events from another program is another. */
+class idivc_source {
+  public:
+  virtual ~idivc_source() {}
+
+  /* Fills ev with the next event and entry with its entry number.
+  Returns false when there are no more. */
+  virtual bool next(idivc_input_event & ev, uint64_t & entry) = 0;
+
+  /* The number of events that will be given, or 0 if not known */
+  virtual uint64_t size() const = 0;
+};
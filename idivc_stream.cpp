@@ -0,0 +1,206 @@
+/**
+  \author Matthew Strait
+  \brief Reads and writes events as a stream of simple binary frames,
+  for feeding idivc as events are taken instead of from base.root files.
+
+  Each frame, in the machine's byte order, is:
+
+    uint32_t magic, IDIVC_FRAME_MAGIC
+    uint32_t nhit, at most IDIVC_NSLOT
+    uint64_t entry number
+    double   tstart[nhit]
+    int16_t  pmt[nhit]
+
+  Hits are in the same order as in base.root. Hits that doit() would
+  ignore may be left out.
+*/
+
+using namespace std;
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "idivc_cont.h"
+#include "idivc_source.h"
+#include "idivc_stream.h"
+
+static const uint32_t IDIVC_FRAME_MAGIC = 0x43564449; // "IDVC"
+
+static const char * const UNIXPREFIX = "unix:";
+
+// How long to wait for the next frame before calling the idle function
+static const int IDLE_MS = 1000;
+
+class stream_source : public idivc_source {
+  public:
+  stream_source(FILE * const f, void (* const idle)()) : in(f), idle(idle)
+  {
+    // Otherwise we can't tell whether a frame is waiting without reading
+    // it, since stdio may already have it
+    if(idle) setvbuf(in, NULL, _IONBF, 0);
+  }
+  ~stream_source() { if(in != stdin) fclose(in); }
+
+  bool next(idivc_input_event & ev, uint64_t & entry)
+  {
+    if(idle){
+      struct pollfd p = { fileno(in), POLLIN, 0 };
+      int ready;
+      while((ready = poll(&p, 1, IDLE_MS)) == 0 ||
+            (ready < 0 && errno == EINTR))
+        if(ready == 0) idle();
+    }
+
+    uint32_t head[2];
+    if(fread(head, sizeof(head), 1, in) != 1) return false;
+
+    if(head[0] != IDIVC_FRAME_MAGIC){
+      fprintf(stderr, "Bad frame in input stream. Exiting.\n");
+      exit(1);
+    }
+    const uint32_t nhit = head[1];
+    if(nhit > IDIVC_NSLOT){
+      fprintf(stderr, "Frame in input stream has %u hits, more than the "
+              "%d allowed. Exiting.\n", nhit, IDIVC_NSLOT);
+      exit(1);
+    }
+
+    memset(ev.tstart, 0, sizeof(ev.tstart));
+    memset(ev.pmt, 0xff, sizeof(ev.pmt));
+
+    if(fread(&entry, sizeof(entry), 1, in) != 1 ||
+       fread(ev.tstart, sizeof(double), nhit, in) != nhit ||
+       fread(ev.pmt, sizeof(short), nhit, in) != nhit){
+      fprintf(stderr, "Input stream ended in the middle of a frame\n");
+      return false;
+    }
+    return true;
+  }
+
+  uint64_t size() const { return 0; }
+
+  private:
+  FILE * in;
+  void (* idle)();
+};
+
+/* Connects to a Unix socket at path, or if server is true, waits for
+one connection to it. Returns the file descriptor. */
+static int unix_socket(const char * const path, const bool server)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)){
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0){
+    perror("socket");
+    exit(1);
+  }
+
+  if(!server){
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))){
+      fprintf(stderr, "Could not connect to %s: %s\n", path,
+              strerror(errno));
+      exit(1);
+    }
+    return fd;
+  }
+
+  unlink(path);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)){
+    fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  const int conn = accept(fd, NULL, NULL);
+  if(conn < 0){
+    perror("accept");
+    exit(1);
+  }
+  close(fd);
+  return conn;
+}
+
+/* Opens a stream of events from where, which is "-" for stdin,
+"unix:path" for a Unix socket that another program is listening on, or
+the name of a file or FIFO. If idle isn't NULL, it is called every
+second that we wait for an event. */
+idivc_source * make_stream_source(const char * const where,
+                                  void (* const idle)())
+{
+  FILE * in;
+  if(!strcmp(where, "-"))
+    in = stdin;
+  else if(!strncmp(where, UNIXPREFIX, strlen(UNIXPREFIX)))
+    in = fdopen(unix_socket(where + strlen(UNIXPREFIX), false), "r");
+  else
+    in = fopen(where, "r");
+
+  if(!in){
+    fprintf(stderr, "Could not open input stream %s\n", where);
+    exit(1);
+  }
+  return new stream_source(in, idle);
+}
+
+/* Opens somewhere to write a stream of events: "-" for stdout,
+"unix:path" to wait for a reader to connect to a Unix socket, or the
+name of a file or FIFO. */
+FILE * open_stream_sink(const char * const where)
+{
+  FILE * out;
+  if(!strcmp(where, "-")){
+    // Keep the real stdout for the events and send our messages, which
+    // would otherwise get mixed in with them, to stderr instead
+    fflush(stdout);
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  }
+  else if(!strncmp(where, UNIXPREFIX, strlen(UNIXPREFIX)))
+    out = fdopen(unix_socket(where + strlen(UNIXPREFIX), true), "w");
+  else
+    out = fopen(where, "w");
+
+  if(!out){
+    fprintf(stderr, "Could not open output stream %s\n", where);
+    exit(1);
+  }
+  return out;
+}
+
+/* Writes one event as a frame, leaving out hits that doit() ignores,
+and flushes it so that the reader isn't kept waiting. */
+void write_frame(FILE * const out, const idivc_input_event & ev,
+                 const uint64_t entry)
+{
+  double tstart[IDIVC_NSLOT];
+  short pmt[IDIVC_NSLOT];
+  uint32_t nhit = 0;
+  for(int i = 0; i < IDIVC_NSLOT; i++){
+    if(ev.pmt[i] < 0 || ev.pmt[i] >= IDIVC_NPMT || ev.tstart[i] <= 0)
+      continue;
+    tstart[nhit] = ev.tstart[i];
+    pmt[nhit] = ev.pmt[i];
+    nhit++;
+  }
+
+  const uint32_t head[2] = { IDIVC_FRAME_MAGIC, nhit };
+  if(fwrite(head, sizeof(head), 1, out) != 1 ||
+     fwrite(&entry, sizeof(entry), 1, out) != 1 ||
+     fwrite(tstart, sizeof(double), nhit, out) != nhit ||
+     fwrite(pmt, sizeof(short), nhit, out) != nhit ||
+     fflush(out)){
+    fprintf(stderr, "Could not write to output stream. Exiting.\n");
+    exit(1);
+  }
+}
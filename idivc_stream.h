@@ -0,0 +1,5 @@
+idivc_source * make_stream_source(const char * const where,
+                                  void (* const idle)());
+FILE * open_stream_sink(const char * const where);
+void write_frame(FILE * const out, const idivc_input_event & ev,
+                 const uint64_t entry);